@@ -48,4 +48,10 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #define KERN_TOP  0xffffffffffffffffULL
 #define KERN_SZ   (KERN_TOP - KERN_BASE)
 
+/* Physical memory is mapped linearly at KERN_BASE up to this address;
+ * what is above it is reserved for other kernel mappings. */
+#define KERN_VMAP_BASE 0xffffffffe0000000ULL
+/* Size of the vmalloc area, which starts at KERN_VMAP_BASE. */
+#define KERN_VMAP_SZ   0x08000000ULL
+
 #endif
@@ -55,4 +55,13 @@ _tst_bit(volatile void *addr, unsigned long nr)
         return val;
 }
 
+/* Returns the index of the least significant set bit in 'word'. The
+ * result is undefined if 'word' is zero. */
+static inline unsigned long
+_ffs(unsigned long word)
+{
+        __asm__("bsf %1,%0" : "=r" (word) : "rm" (word));
+        return word;
+}
+
 #endif
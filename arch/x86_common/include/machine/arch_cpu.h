@@ -40,6 +40,7 @@ THE POSSIBILITY OF SUCH DAMAGE.
  */
 
 #include <machine/params.h>
+#include <stdint.h>
 
 #if WORD_SIZE == 32
 #include <machine/arch_cpu_i386.h>
@@ -70,4 +71,11 @@ static inline int cpuid_string(int code, unsigned int where[4]) {
         return (int)where[0];
 }
 
+/* Read the CPU's time stamp counter. */
+static inline uint64_t rdtsc(void) {
+        uint32_t low, high;
+        __asm__ __volatile__("rdtsc":"=a"(low),"=d"(high));
+        return (uint64_t)low + ((uint64_t)high << 32);
+}
+
 #endif
@@ -56,6 +56,16 @@ typedef unsigned int pgflags_t;
 
 #define _PAGE_PROTNONE  0x080   /* If not present */
 
+/* Software bit: the entry points to a table that is shared by every
+ * address space, rather than owned by this one. */
+#define _PAGE_SHARED_TAB 0x200
+/* Software bit: the entry maps its frame read-only until the first
+ * write, which makes this address space its own copy. */
+#define _PAGE_COW       0x400
+/* Software bit: the entry points to a PTE table that other address
+ * spaces map as well, read-only until the first write through it. */
+#define _PAGE_COW_TAB   0x800
+
 #define PAGE_FLAGS_MASK (GENMASK(11, 0))
 #define PAGE_ADDR_MASK  (~PAGE_FLAGS_MASK)
 
@@ -33,9 +33,18 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #include <machine/regs.h>
 #include <mm/paging.h>
 #include <mm/pfa.h>
+#include <mm/pmm.h>
+#include <mm/vmmap.h>
+#include <mm/vmobject.h>
 #include <sys/kprintf.h>
 #include <sys/stdio.h>
 #include <sys/panic.h>
+#include <sys/proc.h>
+
+/* Page fault error code bits. */
+#define PF_PRESENT      0x1
+#define PF_WRITE        0x2
+#define PF_USER         0x4
 
 bool
 is_user_address(vaddr_t addr)
@@ -43,9 +52,32 @@ is_user_address(vaddr_t addr)
         return !(addr >= KERN_BASE && addr < KERN_TOP);
 }
 
+/* Writes to pages shared across a fork copy them on demand. A copy
+ * takes the place of the page it replaces in the object of the area it
+ * is in, and the original is left to the page tables that still map
+ * it. Forked processes do not get a vmmap yet, so their copies are only
+ * owned by their page tables, as the frames they inherited are. */
+static bool
+handle_cow_fault(vaddr_t fault_addr)
+{
+        proc_t *me = proc_current();
+        vmmap_area_t *area;
+        page_t *orig, *copy;
+
+        if (pmm_cow_fault(me->control.pmm, fault_addr, &orig, &copy))
+                return false;
+        area = copy ? vmmap_find(&me->state.vmmap, fault_addr) : NULL;
+        if (area && vmobject_replace_page(area->object, orig, copy))
+                vmobject_add_page(area->object, copy);
+        return true;
+}
+
 static void
 handle_fault(const struct irq_ctx *r, vaddr_t fault_addr)
 {
+        if ((r->err_code & (PF_PRESENT | PF_WRITE)) == (PF_PRESENT | PF_WRITE)
+            && is_user_address(fault_addr) && handle_cow_fault(fault_addr))
+                return;
         kprintf(0, "Page fault at " PFMT "\n", fault_addr);
         if (is_user_address(fault_addr)) {
                 panic("TODO - kernel faults");
@@ -31,12 +31,14 @@ THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <machine/regs.h>
 #include <machine/types.h>
+#include <mm/mempool.h>
 #include <mm/reserve.h>
 #include <mm/paging.h>
 #include <mm/pmm.h>
 #include <mm/pfa.h>
 #include <mm/vma.h>
 #include <sys/errno.h>
+#include <sys/kprintf.h>
 #include <sys/stdio.h>
 #include <sys/panic.h>
 #include <sys/proc.h>
@@ -53,87 +55,109 @@ pmm_t init_pmm;
 static mem_cache_t *pmm_cache;
 static bool pmm_late_ready = false;
 
-/* Allocate a page that is mapped in to pmm and ready to go. */
+/* Pages set aside for page tables, so that mapping a page (on fork or
+ * in fault handling) can go on when memory is short. A mapping needs
+ * at most one table per level. */
+static mempool_t *table_pool;
+#define PMM_TABLE_RESERVE 8
+
+/* Pages just past the vmalloc range, for the short-lived mappings of
+ * frames that the linear map does not reach. */
+#define PMM_TMAP_VA (KERN_VMAP_BASE + KERN_VMAP_SZ)
+#define PMM_TMAP_NR 2
+
+/* Allocate a zeroed page for a table. Low memory is always in the
+ * linear map, so the table can be used through _va() right away, and
+ * must never be mapped or unmapped there by hand. */
 static void *
-alloc_page(pmm_t *pmm)
+alloc_page(void)
 {
-        page_t *page = pfa_alloc(M_KERNEL);
+        page_t *page = pfa_alloc(M_KERNEL | M_ZERO);
         if (!page)
                 return NULL;
-        paddr_t phys = page_to_phys(page);
-        if (pmm_map(pmm, _va(phys), phys, M_USER | M_ZERO, PFLAGS_RW)) {
-                pfa_free(page);
-                return NULL;
-        }
-        return (void *)_va(phys);
+        pfa_clear_page(page);
+        return (void *)_va(page_to_phys(page));
 }
 
-/* Free a page allocated by alloc_page(). */
-static void
-free_page(pmm_t *pmm, void *addr)
+/* Drop this address space's hold on the table that ent points to.
+ * Returns true if it was the last, and the table is to be freed. Tables
+ * shared by every address space are never freed, and a PTE table that
+ * other address spaces still map loses one of them (see share_pte). */
+static bool
+table_put(pgent_t ent)
 {
-        pmm_unmap(pmm, (vaddr_t)addr, NULL);
-        page_t *page = phys_to_page(_pa(addr));
-        pfa_free(page);
+        page_t *page;
+        if (!pgent_paddr(ent) || (ent & _PAGE_SHARED_TAB))
+                return false;
+        if (!(ent & _PAGE_COW_TAB))
+                return true;
+        page = phys_to_page(pgent_paddr(ent));
+        if (page->shared) {
+                page->shared--;
+                return false;
+        }
+        return true;
 }
 
+/* Frames that the table maps copy-on-write lose a sharer. Only those
+ * entries are looked at, as page->shared is only kept for them. */
 static inline void
 free_pte(pte_t *pte)
 {
+        unsigned long i;
+        for (i = 0; i < PTE_NUM; i++)
+        {
+                page_t *page;
+                if (!(pte->ents[i] & _PAGE_COW))
+                        continue;
+                page = phys_to_page(pgent_paddr(pte->ents[i]));
+                if (page && page->shared)
+                        page->shared--;
+        }
         pfa_free(phys_to_page(_pa(pte)));
 }
 
 #if PMD_BITS == 0
-#define free_pmd(cur_pmm, pmd) free_pte((pte_t *)pmd)
+#define free_pmd(pmd) free_pte((pte_t *)pmd)
 #else
 static inline void
-free_pmd(pmm_t *cur_pmm, pmd_t *pmd)
+free_pmd(pmd_t *pmd)
 {
         unsigned long i;
-        pmm_map(cur_pmm, (vaddr_t)pmd, _pa(pmd), M_KERNEL, PFLAGS_R);
         for (i = 0; i < PMD_NUM; i++)
         {
-                paddr_t phys = pgent_paddr(pmd->ents[i]);
-                if (phys)
-                        free_pte((pte_t *)_va(phys));
+                if (table_put(pmd->ents[i]))
+                        free_pte((pte_t *)_va(pgent_paddr(pmd->ents[i])));
         }
-        pmm_unmap(cur_pmm, (vaddr_t)pmd, NULL);
         pfa_free(phys_to_page(_pa(pmd)));
 }
 #endif
 
 #if PUD_BITS == 0
-#define free_pud(cur_pmm, pud) free_pmd(cur_pmm, (pmd_t *)pud)
+#define free_pud(pud) free_pmd((pmd_t *)pud)
 #else
 static inline void
-free_pud(pmm_t *cur_pmm, pud_t *pud)
+free_pud(pud_t *pud)
 {
         unsigned long i;
-        pmm_map(cur_pmm, (vaddr_t)pud, _pa(pud), M_KERNEL, PFLAGS_R);
         for (i = 0; i < PUD_NUM; i++)
         {
-                paddr_t phys = pgent_paddr(pud->ents[i]);
-                if (phys)
-                        free_pmd(cur_pmm, (pmd_t *)_va(phys));
+                if (table_put(pud->ents[i]))
+                        free_pmd((pmd_t *)_va(pgent_paddr(pud->ents[i])));
         }
-        pmm_unmap(cur_pmm, (vaddr_t)pud, NULL);
         pfa_free(phys_to_page(_pa(pud)));
 }
 #endif
 
 static inline void
-free_pgd(pmm_t *cur_pmm, pgd_t *pgd)
+free_pgd(pgd_t *pgd)
 {
         unsigned long i;
-        /* Make a temporary mapping so we can actually remove the thing. */
-        pmm_map(cur_pmm, (vaddr_t)pgd, _pa(pgd), M_KERNEL, PFLAGS_R);
         for (i = 0; i < PGD_NUM; i++)
         {
-                paddr_t phys = pgent_paddr(pgd->ents[i]);
-                if (phys)
-                        free_pud(cur_pmm, (pud_t *)_va(phys));
+                if (table_put(pgd->ents[i]))
+                        free_pud((pud_t *)_va(pgent_paddr(pgd->ents[i])));
         }
-        pmm_unmap(cur_pmm, (vaddr_t)pgd, NULL);
         pfa_free(phys_to_page(_pa(pgd)));
 }
 
@@ -143,7 +167,12 @@ map_getpage(pmm_t *pmm)
 {
         paddr_t ret;
         if (pfa_ready()) {
-                page_t *pg = pfa_alloc(M_KERNEL);
+                /* A new table must not map anything yet. */
+                page_t *pg = table_pool
+                        ? mempool_alloc(table_pool, M_KERNEL | M_ZERO)
+                        : pfa_alloc(M_KERNEL | M_ZERO);
+                if (pg)
+                        pfa_clear_page(pg);
                 ret = pg ? page_to_phys(pg) : 0;
         } else {
                 ret = reserve_low_pages(pmm->lim, 1);
@@ -222,25 +251,62 @@ pgd_map(pmm_t *pmm, pgd_t *pgd, vaddr_t va, paddr_t pa, mflags_t flags,
         return pud_map(pmm, pud, va, pa, flags, pflags, old_pa);
 }
 
+/* Whether the entries of a pud, or of the pgd, point straight at PTE
+ * tables, the levels in between being folded away. */
+#define PUD_MAPS_PTES (PMD_BITS == 0)
+#define PGD_MAPS_PTES (PUD_BITS == 0 && PMD_BITS == 0)
+
+/* Let dst point to the PTE table that src points to. Both lose write
+ * access through it, and the table counts the extra user in
+ * page->shared; the first write through either gives that address
+ * space a copy of its own (see unshare_pte). */
+static void
+share_pte(pgent_t *dst, pgent_t *src)
+{
+        page_t *page = phys_to_page(pgent_paddr(*src));
+        bug_on(!page, "Page table without a page struct");
+        *src = (*src & ~_PAGE_RW) | _PAGE_COW_TAB;
+        *dst = *src;
+        page->shared++;
+}
+
+/* With 'cow', both tables end up mapping the frames read-only, and
+ * the first write to one of them makes a copy (see pmm_cow_fault).
+ * The copy_* routines above the PTEs share the PTE tables instead of
+ * copying them when 'cow' is set, so that is left until the first
+ * write through one of them. */
 static int
-copy_pte(pte_t *dst, const pte_t *src)
+copy_pte(pte_t *dst, pte_t *src, bool cow)
 {
         unsigned long i;
         for (i = 0; i < PTE_NUM; i++)
         {
-                if (!pgent_paddr(src->ents[i]))
+                pgent_t ent = src->ents[i];
+                page_t *page;
+                if (!pgent_paddr(ent)) {
                         dst->ents[i] = _PAGE_PROTNONE;
-                else
-                        dst->ents[i] = src->ents[i];
+                        continue;
+                }
+                /* Read-only frames are never written, so there is no
+                 * point in counting who shares them. */
+                if (cow && (ent & (_PAGE_RW | _PAGE_COW))) {
+                        ent = (ent & ~_PAGE_RW) | _PAGE_COW;
+                        src->ents[i] = ent;
+                        page = phys_to_page(pgent_paddr(ent));
+                        if (page)
+                                page->shared++;
+                }
+                dst->ents[i] = ent;
         }
         return 0;
 }
 
 #if PMD_BITS == 0
-#define copy_pmd(pmm, dst, src) copy_pte((pte_t *)dst, (pte_t *)src)
+#define copy_pmd(dst, src, cow) \
+        copy_pte((pte_t *)dst, (pte_t *)src, cow)
 #else
 static int
-copy_pmd(pmm_t *cur_pmm, pmd_t *dst, const pmd_t *src)
+copy_pmd(pmd_t *dst, pmd_t *src, bool cow)
 {
         unsigned long i, j;
         for (i = 0; i < PMD_NUM; i++)
@@ -249,33 +315,40 @@ copy_pmd(pmm_t *cur_pmm, pmd_t *dst, const pmd_t *src)
                 pte_t *dpte, *spte;
                 if (!pgent_paddr(src->ents[i]))
                         continue;
-                v = alloc_page(cur_pmm);
+                if (src->ents[i] & _PAGE_SHARED_TAB) {
+                        dst->ents[i] = src->ents[i];
+                        continue;
+                }
+                if (cow) {
+                        share_pte(&dst->ents[i], &src->ents[i]);
+                        continue;
+                }
+                v = alloc_page();
                 if (!v)
                         goto free_tables;
                 dpte = (pte_t *)v;
                 spte = (pte_t *)_va(pgent_paddr(src->ents[i]));
                 dst->ents[i] = _pa(v) | PAGE_TAB;
-                copy_pte(dpte, spte);
-                /* Remove the temp mapping but keep the page alloc'd. */
-                pmm_unmap(cur_pmm, (vaddr_t)v, NULL);
+                copy_pte(dpte, spte, cow);
         }
         return 0;
 free_tables:
-        for (j = 0; j < i; j++)
+        for (j = 0; j <= i; j++)
         {
-                void *v = (void *)_va(pgent_paddr(dst->ents[j]));
-                if (v)
-                        free_page(cur_pmm, v);
+                if (table_put(dst->ents[j]))
+                        free_pte((pte_t *)_va(pgent_paddr(dst->ents[j])));
+                dst->ents[j] = 0;
         }
         return ENOMEM;
 }
 #endif
 
 #if PUD_BITS == 0
-#define copy_pud(pmm, dst, src) copy_pmd(pmm, (pmd_t *)dst, (pmd_t *)src)
+#define copy_pud(dst, src, cow) \
+        copy_pmd((pmd_t *)dst, (pmd_t *)src, cow)
 #else
 static int
-copy_pud(pmm_t *cur_pmm, pud_t *dst, const pud_t *src)
+copy_pud(pud_t *dst, pud_t *src, bool cow)
 {
         unsigned long i, j;
         for (i = 0; i < PUD_NUM; i++)
@@ -284,32 +357,38 @@ copy_pud(pmm_t *cur_pmm, pud_t *dst, const pud_t *src)
                 pmd_t *dpmd, *spmd;
                 if (!pgent_paddr(src->ents[i]))
                         continue;
-                v = alloc_page(cur_pmm);
+                if (src->ents[i] & _PAGE_SHARED_TAB) {
+                        dst->ents[i] = src->ents[i];
+                        continue;
+                }
+                if (cow && PUD_MAPS_PTES) {
+                        share_pte(&dst->ents[i], &src->ents[i]);
+                        continue;
+                }
+                v = alloc_page();
                 if (!v)
                         goto free_tables;
                 dpmd = (pmd_t *)v;
                 spmd = (pmd_t *)_va(pgent_paddr(src->ents[i]));
                 dst->ents[i] = _pa(v) | PAGE_TAB;
-                if (copy_pmd(cur_pmm, dpmd, spmd))
+                if (copy_pmd(dpmd, spmd, cow))
                         goto free_tables;
-                /* Remove the temp mapping but keep the page alloc'd. */
-                pmm_unmap(cur_pmm, (vaddr_t)v, NULL);
         }
         return 0;
 free_tables:
-        for (j = 0; j < i; j++)
+        for (j = 0; j <= i; j++)
         {
-                void *v = (void *)_va(pgent_paddr(dst->ents[j]));
-                if (v)
-                        free_page(cur_pmm, v);
+                if (table_put(dst->ents[j]))
+                        free_pmd((pmd_t *)_va(pgent_paddr(dst->ents[j])));
+                dst->ents[j] = 0;
         }
         return ENOMEM;
 }
 #endif
 
 static int
-copy_pgd(pmm_t *cur_pmm, pgd_t *dst, const pgd_t *src, unsigned int base,
-         unsigned int top)
+copy_pgd(pgd_t *dst, pgd_t *src, unsigned int base, unsigned int top,
+         bool cow)
 {
         unsigned int i, j;
         for (i = base; i < top; i++)
@@ -318,33 +397,93 @@ copy_pgd(pmm_t *cur_pmm, pgd_t *dst, const pgd_t *src, unsigned int base,
                 pud_t *dpud, *spud;
                 if (!pgent_paddr(src->ents[i]))
                         continue;
-                v = alloc_page(cur_pmm);
+                if (src->ents[i] & _PAGE_SHARED_TAB) {
+                        dst->ents[i] = src->ents[i];
+                        continue;
+                }
+                if (cow && PGD_MAPS_PTES) {
+                        share_pte(&dst->ents[i], &src->ents[i]);
+                        continue;
+                }
+                v = alloc_page();
                 if (!v)
                         goto free_tables;
                 dpud = (pud_t *)v;
                 spud = (pud_t *)_va(pgent_paddr(src->ents[i]));
                 dst->ents[i] = _pa(v) | PAGE_TAB;
-                if (copy_pud(cur_pmm, dpud, spud))
+                if (copy_pud(dpud, spud, cow))
                         goto free_tables;
-                /* Remove the temp mapping but keep the page alloc'd. */
-                pmm_unmap(cur_pmm, (vaddr_t)v, NULL);
         }
         return 0;
 free_tables:
-        for (j = 0; j < i; j++)
+        for (j = base; j <= i; j++)
         {
-                void *v = (void *)_va(pgent_paddr(dst->ents[j]));
-                if (v)
-                        free_page(cur_pmm, v);
+                if (table_put(dst->ents[j]))
+                        free_pud((pud_t *)_va(pgent_paddr(dst->ents[j])));
+                dst->ents[j] = 0;
         }
         return ENOMEM;
 }
 
+/* The entry that points to the PTE table for va, or NULL if the tables
+ * above it are missing. */
+static pgent_t *
+pte_parent(pgd_t *pgd, vaddr_t va)
+{
+        pgent_t *ent = pgd->ents + PGD_IND(va);
+#if PUD_BITS != 0
+        if (!pgent_paddr(*ent))
+                return NULL;
+        ent = (pgent_t *)_va(pgent_paddr(*ent)) + PUD_IND(va);
+#endif
+#if PMD_BITS != 0
+        if (!pgent_paddr(*ent))
+                return NULL;
+        ent = (pgent_t *)_va(pgent_paddr(*ent)) + PMD_IND(va);
+#endif
+        return ent;
+}
+
+/* Give p a PTE table of its own for va, if the one it has is shared.
+ * The last address space to let go of a shared table simply takes it
+ * back; the others copy it, which leaves the frames in both copies
+ * mapped copy-on-write. Sets *done, if given, to whether anything
+ * changed, and returns 0 or ENOMEM. */
+static int
+unshare_pte(pmm_t *p, vaddr_t va, bool *done)
+{
+        pgent_t *ent = pte_parent(p->pgdir, va);
+        paddr_t phys, copy;
+        page_t *page;
+
+        if (done)
+                *done = false;
+        if (!ent || !(*ent & _PAGE_COW_TAB))
+                return 0;
+        phys = pgent_paddr(*ent);
+        page = phys_to_page(phys);
+        if (page->shared) {
+                copy = map_getpage(p);
+                if (!copy)
+                        return ENOMEM;
+                copy_pte((pte_t *)_va(copy), (pte_t *)_va(phys), true);
+                page->shared--;
+                phys = copy;
+        }
+        *ent = phys | (*ent & PAGE_FLAGS_MASK & ~_PAGE_COW_TAB) | _PAGE_RW;
+        /* Every page the table maps may have a stale translation. */
+        if (p == proc_current()->control.pmm)
+                pmm_activate(p);
+        if (done)
+                *done = true;
+        return 0;
+}
+
 static void
 pmm_ctor(void *p, __attribute__((unused)) size_t sz)
 {
         pmm_t *pmm = (pmm_t *)p;
-        void *pgd = alloc_page(proc_current()->control.pmm);
+        void *pgd = alloc_page();
         if (!pgd) {
                 /* We must check this later. */
                 pmm->pgdir = NULL;
@@ -359,7 +498,7 @@ static void
 pmm_dtor(void *p, __attribute__((unused)) size_t sz)
 {
         pmm_t *pmm = (pmm_t *)p;
-        free_pgd(proc_current()->control.pmm, pmm->pgdir);
+        free_pgd(pmm->pgdir);
 }
 
 static void
@@ -390,6 +529,49 @@ init_mapping(pud_t *puds, size_t npuds, pmd_t *pmds, size_t npmds,
                    PUD_IND(base), PUD_NUM);
 }
 
+/* A zeroed page from the boot reserve, for a page table. */
+static paddr_t
+boot_table(pmm_t *pmm)
+{
+        paddr_t p = reserve_low_pages(pmm->lim, 1);
+        bzero((void *)_va(p), PAGE_SIZE);
+        return p;
+}
+
+/* The entry at 'ind' in the table that 'ent' points to, which is made
+ * first if there is none yet. */
+static pgent_t *
+boot_table_ent(pmm_t *pmm, pgent_t *ent, unsigned long ind)
+{
+        if (!pgent_paddr(*ent))
+                *ent = boot_table(pmm) | PAGE_TAB;
+        return (pgent_t *)_va(pgent_paddr(*ent)) + ind;
+}
+
+/* Make every page table of the vmalloc area up front and mark them as
+ * shared. Address spaces then link to these tables rather than copying
+ * them, so a vmalloc mapping is seen in all of them as soon as it is
+ * made. */
+static void
+init_vmap_tables(pmm_t *pmm)
+{
+        vaddr_t off;
+        for (off = 0; off < KERN_VMAP_SZ;
+             off += (vaddr_t)PTE_NUM << PAGE_SHIFT)
+        {
+                vaddr_t va = KERN_VMAP_BASE + off;
+                pgent_t *ent = pmm->pgdir->ents + PGD_IND(va);
+#if PUD_BITS != 0
+                ent = boot_table_ent(pmm, ent, PUD_IND(va));
+#endif
+#if PMD_BITS != 0
+                ent = boot_table_ent(pmm, ent, PMD_IND(va));
+#endif
+                boot_table_ent(pmm, ent, 0);
+                *ent |= _PAGE_SHARED_TAB;
+        }
+}
+
 /* Set up the pmm layer (initial page mappings, etc.) */
 /* What we want to do here is to move all of our temporary kernel tables
  * into a new contiguous fixed location, except the page directory
@@ -412,6 +594,9 @@ pmm_init(memlimits_t *lim)
         paddr_t tables_region;
         size_t pg0_index = PGD_IND(_va(lowmem_start(lim)));
         size_t num_ptes, num_pmds, num_puds;
+        /* Map all RAM that could ever be handed out as low memory, so
+         * that the PFA can move blocks into the low zone at will. */
+        paddr_t map_top = paddr_of(linear_pfn_end(lim));
 
         init_pmm.pgdir = &init_pgd;
         init_pmm.pgdir_paddr = _pa(init_pmm.pgdir);
@@ -419,9 +604,9 @@ pmm_init(memlimits_t *lim)
 
         /* Determine how much space we need to hold a full set of kernel
          * page tables, keeping our original pgdir intact. */
-        num_ptes = PTES_NEEDED(lowmem_bytes_avail(lim));
-        num_pmds = PMDS_NEEDED(lowmem_bytes_avail(lim));
-        num_puds = PUDS_NEEDED(lowmem_bytes_avail(lim));
+        num_ptes = PTES_NEEDED(map_top);
+        num_pmds = PMDS_NEEDED(map_top);
+        num_puds = PUDS_NEEDED(map_top);
         tables_region_sz = ( (PTE_SIZE * num_ptes)
                            + (PMD_SIZE * num_pmds)
                            + (PUD_SIZE * num_puds));
@@ -443,16 +628,17 @@ pmm_init(memlimits_t *lim)
         pte_t *ptes = (pte_t *)_va(tables_region + (PUD_SIZE * num_puds)
                                                  + (PMD_SIZE * num_pmds));
         init_mapping(puds, num_puds, pmds, num_pmds, ptes, num_ptes,
-                     KERN_BASE, _va(lowmem_top(lim)));
+                     KERN_BASE, _va(map_top));
 
         /* Load our actual page directory up with the new tables. */
         map_region(init_pmm.pgdir->ents,
                    PGD_NUM - pg0_index,
                    (vaddr_t)puds,
-                   _va(lowmem_top(lim)), pg0_index, PGD_NUM);
+                   _va(map_top), pg0_index, PGD_NUM);
 
         /* Invalidate the TLB to load the new tables up. */
         pmm_activate(&init_pmm);
+        init_vmap_tables(&init_pmm);
         initialized = true;
 }
 
@@ -469,6 +655,8 @@ pmm_init_late(void)
                                      sizeof(pmm_t), 0,
                                      pmm_ctor, pmm_dtor);
         bug_on(!pmm_cache, "Failed to allocate PMM cache");
+        table_pool = mempool_create(NULL, PMM_TABLE_RESERVE);
+        bug_on(!table_pool, "Failed to allocate page table pool");
         pmm_late_ready = true;
 }
 
@@ -480,14 +668,17 @@ pmm_create(void)
 }
 
 int
-pmm_copy_user(pmm_t *dst, const pmm_t *src)
+pmm_copy_user(pmm_t *dst, pmm_t *src)
 {
         if (!dst || !src)
                 return 1;
         unsigned int base = 0;
         unsigned int top = PGD_IND(_va(lowmem_start(src->lim)));
-        return copy_pgd(proc_current()->control.pmm, dst->pgdir,
-                        src->pgdir, base, top);
+        int ret = copy_pgd(dst->pgdir, src->pgdir, base, top, true);
+        /* The source lost write access to its pages. */
+        if (src == proc_current()->control.pmm)
+                pmm_activate(src);
+        return ret;
 }
 
 int
@@ -497,8 +688,7 @@ pmm_copy_kern(pmm_t *dst, const pmm_t *src)
                 return 1;
         unsigned int base = PGD_IND(_va(lowmem_start(src->lim)));;
         unsigned int top = PGD_NUM;
-        return copy_pgd(proc_current()->control.pmm, dst->pgdir,
-                        src->pgdir, base, top);
+        return copy_pgd(dst->pgdir, src->pgdir, base, top, false);
 }
 
 void
@@ -526,15 +716,19 @@ pmm_map(pmm_t *p, vaddr_t va, paddr_t pa, mflags_t flags, pflags_t pflags)
         if (++depth > PMM_MAX_DEPTH) {
                 panic("Maximum pmm_map depth execeeded");
         }
-        int ret = pgd_map(p, p->pgdir, va, pa, flags, pflags, NULL);
+        int ret = unshare_pte(p, va, NULL);
+        if (!ret)
+                ret = pgd_map(p, p->pgdir, va, pa, flags, pflags, NULL);
         if (ret) {
                 --depth;
                 return ret;
         }
-        if (flags & M_ZERO)
-                bzero((void *)va, PAGE_SIZE);
+        /* Pages from the PFA's zero pool need no zeroing. */
         page_t *page = phys_to_page(pa);
+        if ((flags & M_ZERO) && !(page && (page->flags & PG_ZERO)))
+                bzero((void *)va, PAGE_SIZE);
         if (page) {
+                page->flags &= ~PG_ZERO;
                 page->vaddr = va;
         }
         --depth;
@@ -545,7 +739,11 @@ void
 pmm_unmap(pmm_t *p, vaddr_t va, paddr_t *ret_pa)
 {
         paddr_t old_pa = 0;
+        /* The table may not be changed under the others sharing it. */
+        if (unshare_pte(p, va, NULL))
+                panic("Out of memory unsharing a page table");
         pgd_map(p, p->pgdir, va, 0, 0, 0, &old_pa);
+        _tlb_flush(va);
         page_t *page = old_pa ? phys_to_page(old_pa) : NULL;
         if (page) {
                 page->vaddr = 0;
@@ -566,13 +764,13 @@ pte_find(pte_t *p, vaddr_t va)
         return p->ents + PTE_IND(va);
 }
 
-#if PUD_BITS == 0
+#if PMD_BITS == 0
 #define pmd_find(p, va) pte_find((pte_t *)(p), va)
 #else
 static pgent_t *
 pmd_find(pmd_t *p, vaddr_t va)
 {
-        paddr_t phys = pgent_paddr(p->ents[PTE_IND(va)]);
+        paddr_t phys = pgent_paddr(p->ents[PMD_IND(va)]);
         return phys == 0 ? NULL : pte_find((pte_t *)_va(phys), va);
 }
 #endif
@@ -603,6 +801,8 @@ pmm_setprot(pmm_t *p, vaddr_t sva, vaddr_t eva, pflags_t pflags)
                 return;
         while (sva < eva)
         {
+                if (unshare_pte(p, sva, NULL))
+                        return;
                 pgent_t *e = pgd_find(p->pgdir, sva);
                 *e = pgent_paddr(*e) | pflags;
                 sva += PAGE_SIZE;
@@ -628,6 +828,116 @@ pmm_getmap(pmm_t *p, vaddr_t va, paddr_t *ret_pa)
         return false;
 }
 
+/* The address of the frame at phys in p: in the linear map if it is
+ * there, and otherwise in temporary slot 'slot'. Returns 0 if it could
+ * not be mapped. */
+static vaddr_t
+tmap(pmm_t *p, paddr_t phys, unsigned int slot)
+{
+        vaddr_t va = PMM_TMAP_VA + ((vaddr_t)slot << PAGE_SHIFT);
+        bug_on(slot >= PMM_TMAP_NR, "No such temporary slot");
+        if (phys < paddr_of(linear_pfn_end(p->lim)))
+                return _va(phys);
+        if (pmm_map(p, va, phys, M_KERNEL, PFLAGS_RW))
+                return 0;
+        return va;
+}
+
+static void
+tunmap(pmm_t *p, vaddr_t va)
+{
+        if (va >= PMM_TMAP_VA)
+                pmm_unmap(p, va, NULL);
+}
+
+int
+pmm_copy_page(page_t *dst, page_t *src)
+{
+        pmm_t *p = proc_current()->control.pmm;
+        /* Temporary mappings do not count as the pages' addresses. */
+        vaddr_t dva = dst->vaddr, sva = src->vaddr;
+        vaddr_t d, s;
+
+        d = tmap(p, page_to_phys(dst), 0);
+        if (!d)
+                return ENOMEM;
+        s = tmap(p, page_to_phys(src), 1);
+        if (s) {
+                memcpy((void *)d, (void *)s, PAGE_SIZE);
+                tunmap(p, s);
+        }
+        tunmap(p, d);
+        dst->vaddr = dva;
+        src->vaddr = sva;
+        return s ? 0 : ENOMEM;
+}
+
+bool
+pmm_migrate(pmm_t *p, vaddr_t va, page_t *from, page_t *to)
+{
+        pgent_t *ent = p ? pgd_find(p->pgdir, va) : NULL;
+
+        if (!ent)
+                return false;
+        if (pgent_paddr(*ent) == page_to_phys(to))
+                return true;
+        if (pgent_paddr(*ent) != page_to_phys(from))
+                return false;
+        /* A PTE table shared since a fork is changed for everyone that
+         * shares it, which is as it should be, as they all map 'from'. */
+        *ent = page_to_phys(to) | (*ent & PAGE_FLAGS_MASK);
+        if (p == proc_current()->control.pmm)
+                _tlb_flush(va);
+        return true;
+}
+
+int
+pmm_cow_fault(pmm_t *p, vaddr_t va, page_t **origp, page_t **copyp)
+{
+        pgent_t *ent;
+        page_t *page, *copy;
+        vaddr_t dst;
+        bool unshared;
+
+        *origp = *copyp = NULL;
+        if (!p)
+                return EFAULT;
+        va &= ~(vaddr_t)(PAGE_SIZE - 1);
+        /* The PTE table may still be shared since a fork, in which case
+         * it is made private first. The write may then go ahead if it
+         * was only the table that was read-only. */
+        if (unshare_pte(p, va, &unshared))
+                return ENOMEM;
+        ent = pgd_find(p->pgdir, va);
+        if (!ent || !(*ent & _PAGE_COW))
+                return unshared ? 0 : EFAULT;
+        /* Whoever maps the frame last can simply have it back. Anyone
+         * else copies it into a user page of its own. That page is
+         * written through the linear map if it can be, and otherwise
+         * through a temporary mapping. */
+        page = phys_to_page(pgent_paddr(*ent));
+        if (page && page->shared) {
+                copy = pfa_alloc_colored(M_USER & ~M_ZERO, 0, va);
+                if (!copy)
+                        return ENOMEM;
+                dst = tmap(p, page_to_phys(copy), 0);
+                if (!dst) {
+                        pfa_free(copy);
+                        return ENOMEM;
+                }
+                memcpy((void *)dst, (void *)va, PAGE_SIZE);
+                tunmap(p, dst);
+                copy->vaddr = va;
+                *origp = page;
+                *copyp = copy;
+                page->shared--;
+                *ent = page_to_phys(copy) | (*ent & PAGE_FLAGS_MASK);
+        }
+        *ent = (*ent & ~_PAGE_COW) | _PAGE_RW;
+        _tlb_flush(va);
+        return 0;
+}
+
 void
 pmm_activate(pmm_t *p)
 {
@@ -682,3 +992,92 @@ pmm_clear_reference(page_t *pg)
 {
         return pmm_clear_attrs(pg, PM_REF);
 }
+
+__test void
+pmm_test(void)
+{
+        const vaddr_t va = 0x400000;
+        pmm_t *cur = proc_current()->control.pmm;
+        volatile unsigned long *word = (volatile unsigned long *)va;
+        page_t *frame, *orig, *copy, *back, *moved;
+        pgent_t *ea, *eb;
+        pmm_t *a, *b;
+        paddr_t phys;
+
+        a = pmm_create();
+        b = pmm_create();
+        bug_on(!a || !b || !a->pgdir || !b->pgdir, "pmm_create failed");
+        bug_on(pmm_copy_kern(a, cur) || pmm_copy_kern(b, cur),
+               "pmm_copy_kern failed");
+        frame = pfa_alloc(M_KERNEL);
+        bug_on(!frame, "pfa_alloc failed");
+        *(unsigned long *)_va(page_to_phys(frame)) = 0xc0ffee;
+        bug_on(pmm_map(a, va, page_to_phys(frame), M_HIGH, PFLAGS_RW),
+               "pmm_map failed");
+
+        /* A fork shares the PTE table, and leaves the frames in it
+         * alone until something is written through it. */
+        bug_on(pmm_copy_user(b, a), "pmm_copy_user failed");
+        ea = pte_parent(a->pgdir, va);
+        eb = pte_parent(b->pgdir, va);
+        bug_on(!ea || !eb || *ea != *eb || (*ea & _PAGE_RW) ||
+               !(*ea & _PAGE_COW_TAB), "PTE table not shared");
+        bug_on(phys_to_page(pgent_paddr(*ea))->shared != 1,
+               "Table sharer not counted");
+        bug_on(*pgd_find(a->pgdir, va) & _PAGE_COW,
+               "Frame marked before the table was written");
+
+        /* The child's first write copies the table, then the frame. */
+        pmm_activate(b);
+        bug_on(pmm_cow_fault(b, va, &orig, &copy), "pmm_cow_fault failed");
+        bug_on(*word != 0xc0ffee, "Copy has the wrong contents");
+        *word = 0xdead;
+        pmm_activate(cur);
+        bug_on(orig != frame || !copy || copy == frame, "Frame not copied");
+        bug_on(pgent_paddr(*eb) == pgent_paddr(*ea) || !(*eb & _PAGE_RW) ||
+               (*eb & _PAGE_COW_TAB), "Child kept the shared table");
+        bug_on(phys_to_page(pgent_paddr(*ea))->shared || frame->shared,
+               "Child still counted as a sharer");
+        bug_on(*(unsigned long *)_va(page_to_phys(frame)) != 0xc0ffee,
+               "Child's write reached the parent");
+
+        /* That leaves the parent with both to itself, and it takes
+         * them back without copying. */
+        bug_on(pmm_cow_fault(a, va, &orig, &back) || orig || back,
+               "Parent made a copy");
+        bug_on(!(*ea & _PAGE_RW) || (*ea & _PAGE_COW_TAB) ||
+               !pmm_getmap(a, va, &phys) || phys != page_to_phys(frame) ||
+               (*pgd_find(a->pgdir, va) & _PAGE_COW),
+               "Parent did not take its pages back");
+        pmm_destroy(b);
+        pfa_free(copy);
+
+        /* A child that goes away lets go of the tables it shared. */
+        b = pmm_create();
+        bug_on(!b || pmm_copy_kern(b, cur) || pmm_copy_user(b, a),
+               "Fork failed");
+        bug_on(phys_to_page(pgent_paddr(*ea))->shared != 1,
+               "Table sharer not counted");
+        pmm_destroy(b);
+        bug_on(phys_to_page(pgent_paddr(*ea))->shared,
+               "Destroyed child still counted as a sharer");
+
+        /* A page moved for compaction keeps its contents and its
+         * mapping. */
+        moved = pfa_alloc(M_HIGH);
+        bug_on(!moved || pmm_copy_page(moved, frame),
+               "pmm_copy_page failed");
+        bug_on(!pmm_migrate(a, va, frame, moved) ||
+               !pmm_getmap(a, va, &phys) || phys != page_to_phys(moved),
+               "Mapping not moved");
+        bug_on(pmm_migrate(a, va + PAGE_SIZE, frame, moved),
+               "Moved a mapping that is not there");
+        pmm_activate(a);
+        bug_on(*word != 0xc0ffee, "Moved page lost its contents");
+        pmm_activate(cur);
+
+        pmm_destroy(a);
+        pfa_free(moved);
+        pfa_free(frame);
+        kprintf(0, "pmm_test passed\n");
+}
@@ -90,14 +90,16 @@ cpu_t *arch_cpu_current();
         __attribute__((section("data_percpu"))) \
                 type __per_cpu_##name
 
-// Retrieves the per-CPU value of 'var' for the indexed CPU.
-#define PERCPU_GET_FOR_IND(var, cpuind) \
-        (typeof(var) *)(cpu_get(cpuind)->_percpu + _PERCPU_OFFSETOF(var))
-// Retrieves the per-CPU value of 'var' for the passed CPU struct.
-#define PERCPU_GET_FOR_CPU(var, cpu) \
-        (typeof(var) *)(cpu->_percpu + _PERCPU_OFFSETOF(var))
-// Retrieves the per-CPU value of 'var' for the current CPU.
-#define PERCPU_GET(var) PERCPU_GET_FOR_CPU(var, CPU_CURRENT())
+// Retrieves a pointer to the per-CPU variable 'name' for the indexed CPU.
+#define PERCPU_GET_FOR_IND(name, cpuind) \
+        PERCPU_GET_FOR_CPU(name, cpu_get(cpuind))
+// Retrieves a pointer to the per-CPU variable 'name' for the passed CPU
+// struct.
+#define PERCPU_GET_FOR_CPU(name, cpu) \
+        ((__typeof__(__per_cpu_##name) *) \
+         ((cpu)->_percpu + PERCPU_OFFSETOF(name)))
+// Retrieves a pointer to the per-CPU variable 'name' for the current CPU.
+#define PERCPU_GET(name) PERCPU_GET_FOR_CPU(name, cpu_current())
 
 // Internal helpers
 
@@ -112,7 +114,7 @@ GLOBAL(__stop_data_percpu);
 #define PERCPU_LIMIT (&__stop_data_percpu)
 #define PERCPU_SZ ((uintptr_t)PERCPU_LIMIT - (uintptr_t)PERCPU_START)
 #define PERCPU_OFFSETOF(name) \
-        ((uintptr_t)(&__per_cpu##name) - PERCPU_START)
+        ((uintptr_t)(&__per_cpu_##name) - (uintptr_t)PERCPU_START)
 
 
 #endif
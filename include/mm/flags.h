@@ -39,6 +39,7 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #define M_HIGH_BIT 1
 #define M_DMA_BIT  2
 #define M_ZERO_BIT 3
+#define M_MOVABLE_BIT 4
 #define MFLAGS_GOOD_MASK (GENMASK(4, 0))
 #define BAD_MFLAGS(f) ((f) & ~MFLAGS_GOOD_MASK)
 
@@ -46,10 +47,11 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #define M_HIGH     (1 << M_HIGH_BIT)
 #define M_DMA      (1 << M_DMA_BIT)
 #define M_ZERO     (1 << M_ZERO_BIT)
+#define M_MOVABLE  (1 << M_MOVABLE_BIT) // Can be moved by pfa_compact
 
 #define M_BUFFER   (         M_WAIT)
 #define M_ATOMIC   (0)
-#define M_USER     (M_HIGH | M_WAIT | M_ZERO)
+#define M_USER     (M_HIGH | M_WAIT | M_ZERO | M_MOVABLE)
 #define M_KERNEL   (         M_WAIT)
 
 typedef uint32_t mflags_t;
@@ -36,20 +36,63 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #include <stddef.h>
 #include <mm/paging.h>
 
+/* Maximum number of discontiguous ranges of RAM that are tracked. */
+#define MEMLIMITS_MAX_REGIONS 32
+
+/* Page frames at or above this are not part of the kernel's linear
+ * mapping of physical memory, and so cannot be low memory. */
+#define LOWMEM_MAX_PFN (PFN_DOWN(KERN_VMAP_BASE - KERN_BASE))
+
+/* A range of usable RAM. */
+typedef struct {
+        size_t start_pfn;       // First page frame in the region
+        size_t end_pfn;         // First page frame past the region
+} memregion_t;
+
+/* Physical memory is divided into DMA, low and high pages, in that
+ * order. The zones may contain holes; only the page frames that are
+ * covered by one of the (sorted, disjoint) regions are usable. */
 typedef struct {
-        size_t max_pfn;         // Number of total pages available
+        size_t max_pfn;         // First page frame past the end of RAM
         size_t high_pfn;        // Start of the 'high' (user) pages
         size_t low_pfn;         // Start of the 'low' (kernel) pages
         size_t dma_pfn;         // Index of the first DMA page
         size_t dma_pfn_end;     // First index above dma_pfn that is non-DMA
+        unsigned int nr_regions;
+        memregion_t regions[MEMLIMITS_MAX_REGIONS];
 } memlimits_t;
 
 void
 detect_memory_limits(memlimits_t *to, multiboot_info_t *mbd);
 
+/* Add [start_pfn, end_pfn) to the usable RAM regions, merging it with
+ * any region it overlaps or touches. */
+void
+memlimits_add_region(memlimits_t *lim, size_t start_pfn, size_t end_pfn);
+
 void
 limits_report(memlimits_t *);
 
+/* Number of usable page frames in [start_pfn, end_pfn). */
+static inline size_t
+range_pages_avail(memlimits_t *lim, size_t start_pfn, size_t end_pfn)
+{
+        size_t n = 0;
+        unsigned int i;
+        for (i = 0; i < lim->nr_regions; i++)
+        {
+                size_t s = lim->regions[i].start_pfn;
+                size_t e = lim->regions[i].end_pfn;
+                if (s < start_pfn)
+                        s = start_pfn;
+                if (e > end_pfn)
+                        e = end_pfn;
+                if (s < e)
+                        n += e - s;
+        }
+        return n;
+}
+
 static inline paddr_t
 mem_max(memlimits_t *lim)
 {
@@ -71,7 +114,7 @@ dma_end(memlimits_t *lim)
 static inline size_t
 dma_pages_avail(memlimits_t *lim)
 {
-        return (lim->dma_pfn_end - lim->dma_pfn);
+        return range_pages_avail(lim, lim->dma_pfn, lim->dma_pfn_end);
 }
 
 static inline size_t
@@ -95,7 +138,7 @@ lowmem_end(memlimits_t *lim)
 static inline size_t
 lowmem_pages_avail(memlimits_t *lim)
 {
-        return (lim->high_pfn - lim->low_pfn);
+        return range_pages_avail(lim, lim->low_pfn, lim->high_pfn);
 }
 
 static inline size_t
@@ -119,7 +162,7 @@ highmem_end(memlimits_t *lim)
 static inline size_t
 highmem_pages_avail(memlimits_t *lim)
 {
-        return (lim->max_pfn - lim->high_pfn);
+        return range_pages_avail(lim, lim->high_pfn, lim->max_pfn);
 }
 
 static inline size_t
@@ -142,6 +185,15 @@ allmem_bytes_avail(memlimits_t *lim)
         return (PAGE_SIZE * allmem_pages_avail(lim));
 }
 
+/* First page frame past the kernel's linear mapping of RAM. Every frame
+ * below this can be used as low memory. */
+static inline size_t
+linear_pfn_end(memlimits_t *lim)
+{
+        return (lim->max_pfn < LOWMEM_MAX_PFN ? lim->max_pfn
+                                              : LOWMEM_MAX_PFN);
+}
+
 static inline paddr_t
 dma_base(memlimits_t *lim)
 {
@@ -181,19 +233,19 @@ highmem_top(memlimits_t *lim)
 static inline bool
 is_dma(memlimits_t *lim, paddr_t paddr)
 {
-        return (dma_base(lim) <= paddr && dma_top(lim) >= paddr);
+        return (dma_base(lim) <= paddr && dma_top(lim) > paddr);
 }
 
 static inline bool
 is_lowmem(memlimits_t *lim, paddr_t paddr)
 {
-        return (lowmem_base(lim) <= paddr && lowmem_top(lim) >= paddr);
+        return (lowmem_base(lim) <= paddr && lowmem_top(lim) > paddr);
 }
 
 static inline bool
 is_highmem(memlimits_t *lim, paddr_t paddr)
 {
-        return (highmem_base(lim) <= paddr && highmem_top(lim) >= paddr);
+        return (highmem_base(lim) <= paddr && highmem_top(lim) > paddr);
 }
 
 
@@ -0,0 +1,78 @@
+/*
+Copyright (c) 2016, James Sullivan <sullivan.james.f@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote
+      products derived from this software without specific prior
+      written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER>
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _MM_MEMPOOL_H_
+#define _MM_MEMPOOL_H_
+
+/*
+ * mm/mempool.h - Reserved objects for allocations that must not fail.
+ *
+ * A mempool_t sits on top of a memory cache and keeps a reserve of at
+ * least `min' of its objects allocated ahead of time. Allocations go to
+ * the cache as usual, and only fall back to the reserve when the cache
+ * cannot come up with an object. Frees top the reserve back up before
+ * anything goes back to the cache.
+ *
+ * A pool made without a cache holds single pages from the PFA instead,
+ * handed out as page_t pointers. Those are not zeroed from the reserve,
+ * so M_ZERO callers should still run pfa_clear_page on them.
+ */
+
+#include <mm/flags.h>
+#include <mm/vma.h>
+
+typedef struct mempool {
+        mem_cache_t   *cache;           /* NULL for a pool of pages */
+        unsigned long  min;             /* Objects to keep in reserve */
+        unsigned long  nr;              /* Objects in reserve now */
+        unsigned long  nr_drawn;        /* Allocations the reserve met */
+        void          *reserve[];
+} mempool_t;
+
+/* Create a pool of objects from cp (or of pages, if cp is NULL) with
+ * `min' of them set aside. Returns NULL if the reserve could not be
+ * filled. */
+mempool_t *mempool_create(mem_cache_t *cp, unsigned long min);
+
+/* Give the reserve back to the cache and free the pool. Objects that
+ * are out must have been freed already. */
+void mempool_destroy(mempool_t *pool);
+
+/* Allocate an object from the pool, as mem_cache_alloc would. Returns
+ * NULL only when the cache has failed and the reserve is empty. */
+void *mempool_alloc(mempool_t *pool, mflags_t flags);
+
+/* Return an object allocated from the pool. */
+void mempool_free(mempool_t *pool, void *obj);
+
+__test void mempool_test(void);
+
+#endif
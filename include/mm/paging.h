@@ -64,9 +64,26 @@ static inline size_t PAGE_ROUNDUP(size_t sz)
  * mapped to is stored and is updated by the PMM system. */
 typedef struct page {
         vaddr_t vaddr;
-        unsigned long order; // Used by the PFA internally.
+        unsigned long flags; // PG_* flags, and the page's memory section
+        unsigned long order; // Block order; used by the PFA internally.
         struct list_head list; // Used by the PFA internally.
         struct page *next; // Next page; see mm/vmobject.h
+        /* Slab pages, vmalloc pages and user pages never overlap. */
+        union {
+                struct slab *slab; // Slab the page is part of; see mm/vma_slab.c
+                struct vm_area *vm_area; // Area the page starts; see mm/vmalloc.c
+                unsigned long shared; // Extra copy-on-write mappings; see mm/pmm.h
+        };
 } page_t;
 
+/* Page flags. The bits from PG_SECTION_SHIFT up hold the index of the
+ * memory section the page belongs to (see mm/pfa.h). */
+#define PG_BUDDY        (1UL << 0) // Head of a free block in the PFA
+#define PG_ZONE_SHIFT   1          // PFA zone the page currently belongs to
+#define PG_ZONE_MASK    (3UL << PG_ZONE_SHIFT)
+#define PG_MOVABLE      (1UL << 3) // Allocated with M_MOVABLE
+#define PG_ZERO         (1UL << 4) // Known to be zero-filled
+#define PG_SECTION_SHIFT 8
+#define PG_FLAGS_MASK   ((1UL << PG_SECTION_SHIFT) - 1)
+
 #endif /* _MM_PAGING_H_ */
@@ -33,7 +33,9 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #define _MM_PFA_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/debug.h>
+#include <sys/time_constants.h>
 #include <mm/flags.h>
 #include <mm/memlimits.h>
 #include <mm/paging.h>
@@ -41,11 +43,122 @@ THE POSSIBILITY OF SUCH DAMAGE.
 
 #define PFA_MAX_PAGE_ORDER 12
 
+/* The zones that the PFA carves physical memory into. */
+typedef enum {
+        PFA_ZONE_DMA,
+        PFA_ZONE_LOW,
+        PFA_ZONE_HIGH,
+        PFA_NR_ZONES,
+} pfa_zone_id_t;
+
 /* A block is a list of free pages of a common order. */
 typedef struct {
         struct list_head list;
+        unsigned long    nr_free;       /* Blocks on the list */
 } pfa_block_t;
 
+/* Physical memory is split into naturally aligned sections, each much
+ * larger than the biggest buddy block. Page structs only exist for
+ * sections that contain some RAM, and are initialized lazily, a
+ * section at a time. */
+#define PFA_SECTION_ORDER 15
+#define PFA_SECTION_PAGES (1UL << PFA_SECTION_ORDER)
+
+typedef struct {
+        page_t       *pages;    /* NULL if the section has no RAM */
+        bool          ready;    /* Page structs are initialized */
+} pfa_section_t;
+
+/* Free page watermarks of a zone.
+ *
+ * Once a zone drops below its low mark, memory is reclaimed in the
+ * background until it is back above the high mark. An allocation that
+ * can wait and would take the zone below its min mark reclaims memory
+ * itself first, and fails if that does not help; the pages below min
+ * are kept for allocations that cannot wait. */
+typedef enum {
+        PFA_WMARK_MIN,
+        PFA_WMARK_LOW,
+        PFA_WMARK_HIGH,
+        PFA_NR_WMARKS,
+} pfa_wmark_t;
+
+/* Page colors. Frames whose numbers agree in the low PFA_COLOR_ORDER
+ * bits share sets in a physically indexed L2 cache, so pages that are
+ * used together are best given different colors. A naturally aligned
+ * block of 2^PFA_COLOR_ORDER pages holds one page of every color.
+ *
+ * At most PFA_COLOR_POOL_HIGH single pages are kept sorted by color in
+ * each zone, for colored allocations. */
+#define PFA_COLOR_ORDER         4
+#define PFA_NR_COLORS           (1UL << PFA_COLOR_ORDER)
+#define PFA_COLOR_POOL_HIGH     (4 * PFA_NR_COLORS)
+
+/* The color that a page mapped at 'va' should have. */
+#define pfa_color_of(va) (((va) >> PAGE_SHIFT) & (PFA_NR_COLORS - 1))
+
+/* The buddy lists of a zone. Bit i of order_map is set iff blocks[i]
+ * is non-empty, so the smallest block that can satisfy an allocation
+ * is found with a single bit scan.
+ *
+ * Pages in [init_pfn, end_pfn) belong to the zone but have not been
+ * initialized or put on the free lists yet.
+ *
+ * The low and high zones are not fixed in size. When one of them drops
+ * below its low mark, it borrows a free max-order block from the other,
+ * provided that leaves the lender above its own high mark. The zone a
+ * page belongs to is kept in its flags. */
+typedef struct {
+        pfa_block_t   blocks[PFA_MAX_PAGE_ORDER];
+        unsigned long order_map;
+        unsigned long nr_free_pages;    /* Pages on the buddy lists */
+        unsigned long init_pfn;
+        unsigned long end_pfn;
+        unsigned long wmark[PFA_NR_WMARKS];
+        unsigned long nr_throttled;     /* Allocations failed at min */
+        unsigned long nr_borrowed;      /* Blocks taken from another zone */
+        unsigned long nr_lent;          /* Blocks given to another zone */
+        unsigned long nr_fallback;      /* Allocations served elsewhere */
+        struct list_head zero_pages;    /* Pre-zeroed pages */
+        unsigned long nr_zero;
+        struct list_head color_pages[PFA_NR_COLORS];
+        unsigned long nr_colored;       /* Pages on the color lists */
+} pfa_zone_t;
+
+/* Number of pre-zeroed pages kept for M_ZERO allocations in each of
+ * the low and high zones, the number zeroed at a time, and how often
+ * (in microseconds) the pools are topped up and background reclaim is
+ * run. */
+#define PFA_ZERO_POOL_HIGH      256
+#define PFA_ZERO_POOL_BATCH     32
+#define PFA_ZERO_INTERVAL_US    (10 * USEC_PER_MSEC)
+
+/* Number of order-0 pages moved between a per-CPU cache and the buddy
+ * lists at a time, and the size at which a cache is drained. */
+#define PFA_PCP_BATCH   16
+#define PFA_PCP_HIGH    (4 * PFA_PCP_BATCH)
+
+/* A per-CPU cache of order-0 pages for a single zone.
+ *
+ * Freed pages go to the head of the hot list, since they were most
+ * likely touched recently and are still in the CPU's caches. Pages
+ * pulled from the buddy lists in a refill go to the cold list. Both
+ * lists are allocated from head-first, hot before cold; draining gives
+ * back cold pages first.
+ *
+ * Pages in a per-CPU cache are still marked as allocated as far as the
+ * buddy lists are concerned, so they are never coalesced. */
+typedef struct {
+        struct list_head hot;
+        struct list_head cold;
+        unsigned int     count;         /* Pages on both lists */
+} pfa_pcp_t;
+
+typedef struct {
+        bool      ready;
+        pfa_pcp_t zones[PFA_NR_ZONES];
+} pfa_pcpu_t;
+
 /* The Page Frame Allocator object which manages physical memory.
  *
  * The PFA segments memory into several zones (DMA, low, high):
@@ -54,9 +167,17 @@ typedef struct {
  *      DMA  - Direct Memory Access pages
  *
  * Pages can be fetched from the PFA via the pfa_{alloc,free}_pages
- * routines. A global table of page structs is maintained and mapped
- * into memory; these page structs contain metadata used for allocation
- * purposes and for mapping physical page frames to virtual addresses.
+ * routines. Single pages are served from a per-CPU cache (pfa_pcp_t)
+ * where possible, which is refilled from and drained to the buddy lists
+ * in batches. A table of page structs is maintained and mapped into
+ * memory for each section of physical memory that has RAM in it; these
+ * page structs contain metadata used for allocation purposes and for
+ * mapping physical page frames to virtual addresses.
+ *
+ * To keep boot fast, pfa_init only sets up the page structs of the DMA
+ * zone and the first section of low memory. The remaining sections are
+ * initialized on demand when a zone runs dry, and all at once by the
+ * pfa_init_deferred sysinit step.
  *
  * The pages returned by the PFA are *not* mapped into virtual memory
  * yet; this is the low-level mechanism by which physical pages can be
@@ -65,22 +186,45 @@ typedef struct {
  */
 typedef struct {
         memlimits_t  *limits;
-        page_t       *pages;
-        unsigned long *tag_bits;
+        pfa_section_t *sections;
+        unsigned long nr_sections;
         bool          ready;
-        pfa_block_t   dma_zones[PFA_MAX_PAGE_ORDER];
-        pfa_block_t   low_zones[PFA_MAX_PAGE_ORDER];
-        pfa_block_t   high_zones[PFA_MAX_PAGE_ORDER];
+        bool          pcp_ready;
+        uint64_t      boot_cycles;      /* Spent in pfa_init */
+        uint64_t      deferred_cycles;  /* Spent on deferred sections */
+        unsigned long nr_compacted;     /* Blocks freed up by compaction */
+        unsigned long nr_compact_fail;
+        unsigned long nr_migrated;      /* Blocks moved by compaction */
+        unsigned long nr_zero_hits;     /* M_ZERO served pre-zeroed */
+        unsigned long nr_zero_misses;
+        unsigned long nr_color_hits;    /* Colored pages off the lists */
+        unsigned long nr_color_splits;  /* Blocks split up by color */
+        unsigned long reclaim_zones;    /* Zones below their low mark */
+        unsigned long nr_reclaimed;     /* Pages given back by reclaim */
+        unsigned long nr_direct_reclaim;
+        unsigned long nr_bg_reclaim;
+        pfa_zone_t    zones[PFA_NR_ZONES];
 } pfa_t;
 
 /* The system-wide page frame allocator object. */
 extern pfa_t pfa;
 
-/* Returns the first page in memory. */
-page_t *pfa_base(void);
-
 /* Initialize the PFA subsystem. */
 void pfa_init(memlimits_t *limits);
+/* Initialize every section that was deferred at boot. */
+int pfa_init_deferred(void);
+/* Enable the per-CPU page caches. To be called once the CPU control
+ * block of the running CPU is set up. */
+void pfa_init_late(void);
+/* Fill the zero pools, and start refilling them and reclaiming memory
+ * in the background. */
+int pfa_init_background(void);
+/* Zero up to 'max' pages for the zero pools. Returns the number of
+ * pages zeroed. */
+unsigned long pfa_zero_refill(unsigned long max);
+/* Return every page held in the current CPU's page caches to the
+ * buddy lists. */
+void pfa_drain_pcp(void);
 /* Returns true if the PFA system is ready, false otherwise. */
 bool pfa_ready(void);
 /* Dump out a report of the available memory. When `full' is set, give
@@ -91,26 +235,94 @@ __test void pfa_test(void);
 
 #define PFA_MAP_INDEX(paddr)   ((unsigned long)paddr >> PAGE_SHIFT)
 
+/* Translates a page frame number to its page struct, or NULL if the
+ * frame is not in a section with RAM. */
+static inline page_t *
+pfn_to_page(unsigned long pfn)
+{
+        unsigned long sec = pfn >> PFA_SECTION_ORDER;
+        if (sec >= pfa.nr_sections || !pfa.sections[sec].pages)
+                return NULL;
+        return pfa.sections[sec].pages + (pfn & (PFA_SECTION_PAGES - 1));
+}
+
+/* Translates a page struct to its page frame number. */
+static inline unsigned long
+page_to_pfn(page_t *page)
+{
+        unsigned long sec = page->flags >> PG_SECTION_SHIFT;
+        return (sec << PFA_SECTION_ORDER) + (page - pfa.sections[sec].pages);
+}
+
 /* Translates a physical address to its corresponding page struct. */
 static inline page_t *
 phys_to_page(paddr_t paddr)
 {
-        if (!pfa_base())
-                return NULL;
-        return pfa_base() + PFA_MAP_INDEX(paddr);
+        return pfn_to_page(PFA_MAP_INDEX(paddr));
 }
 
 /* Translate a page struct to its corresponding physical address. */
 static inline paddr_t
 page_to_phys(page_t *page)
 {
-        return (page - pfa_base()) * PAGE_SIZE;
+        return paddr_of((paddr_t)page_to_pfn(page));
 }
 
 /* Returns the first page in a range of physical pages of size
- * (1<<order). The pages are not mapped into virtual memory yet. */
+ * (1<<order). The pages are not mapped into virtual memory yet.
+ * With M_WAIT, a failed allocation compacts the zone and tries again.
+ * With M_ZERO, a single page comes out of the zone's zero pool if it
+ * can; PG_ZERO is set on the page if it is known to be zero-filled.
+ * With M_MOVABLE, the block may later be moved elsewhere by the
+ * migrate routine (see pfa_set_migrate). */
 page_t *pfa_alloc_pages(mflags_t, unsigned int order);
 void    pfa_free_pages (page_t *, unsigned int order);
+/* As pfa_alloc_pages, but try to return a block whose first page has
+ * the color of 'va', the address that it is going to be mapped at.
+ * Blocks of order PFA_COLOR_ORDER and up span every color. If no page
+ * of the color is at hand, any page is returned. */
+page_t *pfa_alloc_colored(mflags_t, unsigned int order, vaddr_t va);
+
+/* Returns the first page in a range of 'npages' physically contiguous
+ * pages, which may be bigger than the largest buddy block. The range
+ * must be given back with pfa_free_contig. */
+page_t *pfa_alloc_contig(mflags_t, unsigned long npages);
+void    pfa_free_contig (page_t *, unsigned long npages);
+
+/* Moves the contents of the allocated block at 'from' to the freshly
+ * allocated block at 'to' (of the same order), and points everything
+ * that referred to 'from' at 'to' instead. Returns false if the block
+ * cannot be moved right now. */
+typedef bool (*pfa_migrate_t)(page_t *from, page_t *to,
+                              unsigned int order);
+
+/* Set the routine used to move M_MOVABLE blocks. */
+void pfa_set_migrate(pfa_migrate_t);
+/* Move movable blocks out of the way to create a free block of the
+ * given order in the zone used for 'flags'. Returns true if one was
+ * made. */
+bool pfa_compact(mflags_t, unsigned int order);
+
+/* A reclaim callback, which is asked to give about 'nr' pages back to
+ * the PFA when memory runs low, and returns the number it freed. The
+ * callback may free memory, but must not allocate any. */
+typedef struct pfa_reclaimer {
+        const char       *name;
+        unsigned long   (*reclaim)(unsigned long nr);
+        struct list_head  list;
+} pfa_reclaimer_t;
+
+/* Add or remove a reclaim callback. Callbacks are run in the order
+ * that they were registered. */
+void pfa_register_reclaim(pfa_reclaimer_t *);
+void pfa_unregister_reclaim(pfa_reclaimer_t *);
+/* Run the reclaim callbacks until about 'nr' pages have been freed.
+ * Returns the number of pages freed. */
+unsigned long pfa_reclaim(unsigned long nr);
+
+/* Zero-fill a page through the kernel's linear mapping, unless it is
+ * known to be zero already. The page must lie below linear_pfn_end. */
+void    pfa_clear_page(page_t *);
 
 /* Convenience macros for single-page allocations. */
 #define pfa_alloc(flags) pfa_alloc_pages(flags, 0)
@@ -49,6 +49,7 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #include <mm/arch_pmm.h>
 #include <mm/paging.h>
 #include <stdbool.h>
+#include <sys/debug.h>
 
 extern pmm_t init_pmm;
 
@@ -68,9 +69,33 @@ pmm_init_late(void);
 pmm_t *
 pmm_create(void);
 
-/* Copy the user page table mappings from one pmm to another. */
+/* Copy the user page table mappings from one pmm to another. The PTE
+ * tables themselves are shared, read-only, until the first write
+ * through one of them copies it. From then on the frames in it are
+ * shared copy-on-write: both copies lose write access to them, and
+ * each writable frame counts the extra mapping in page->shared. */
 int
-pmm_copy_user(pmm_t *dst, const pmm_t *src);
+pmm_copy_user(pmm_t *dst, pmm_t *src);
+
+/* Resolve a write fault at va on a copy-on-write page, by copying the
+ * frame or, if no one else maps it any more, by taking it back. Returns
+ * 0 if va is now writable, EFAULT if it is not a copy-on-write page, or
+ * ENOMEM. The new page, if there is one, is put in *copyp and the page
+ * it replaced in *origp; handing ownership over is up to the caller. */
+int
+pmm_cow_fault(pmm_t *, vaddr_t va, page_t **origp, page_t **copyp);
+
+/* Copy the contents of the frame 'src' into the frame 'dst', which need
+ * not be in the linear map. Returns 0 or ENOMEM. */
+int
+pmm_copy_page(page_t *dst, page_t *src);
+
+/* Point the mapping of 'from' at va in the pmm to 'to' instead, keeping
+ * its protection. Returns false if the pmm maps neither page there; a
+ * PTE table shared with another pmm may already have been moved over.
+ * Used to move user pages (see pfa_set_migrate). */
+bool
+pmm_migrate(pmm_t *, vaddr_t va, page_t *from, page_t *to);
 
 /* Copy the kernel page table mappings from one pmm to another. */
 int
@@ -165,4 +190,6 @@ pmm_is_referenced(page_t *pg);
 bool
 pmm_clear_reference(page_t *pg);
 
+__test void pmm_test(void);
+
 #endif
@@ -32,9 +32,12 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef _MM_VMA_H_
 #define _MM_VMA_H_
 
+#include <machine/params.h>
+#include <machine/types.h>
 #include <mm/flags.h>
 #include <sys/config.h>
 #include <sys/debug.h>
+#include <stdbool.h>
 
 #ifdef CONF_VMA_SLAB
 #include <mm/vma_slab.h>
@@ -54,6 +57,36 @@ void vma_init(void);
 void vma_report(void);
 __test void vma_test(void);
 
+#define MEM_CACHE_STAT_NAMELEN 32
+
+/* The counters of a memory cache at one point in time, as given out by
+ * mem_cache_stats() and the slabinfo system call. */
+typedef struct mem_cache_stat {
+        char          name[MEM_CACHE_STAT_NAMELEN];
+        char          merged[MEM_CACHE_STAT_NAMELEN]; /* Backing cache */
+        unsigned long obj_size;         /* Bytes asked for per object */
+        unsigned long slot_size;        /* Bytes taken up per object */
+        unsigned long allocs;           /* Objects handed out, ever */
+        unsigned long frees;            /* Objects given back, ever */
+        unsigned long active;           /* Objects handed out now */
+        unsigned long total;            /* Objects the slabs hold */
+        unsigned long cached;           /* Free objects in magazines */
+        unsigned long depot;            /* Full magazines in the depot */
+        unsigned long grows;            /* Slabs created */
+        unsigned long reaps;            /* Empty slabs destroyed */
+        unsigned long slabs_full;
+        unsigned long slabs_partial;
+        unsigned long slabs_empty;
+        unsigned long wastage;          /* Bytes of slab not given out */
+} mem_cache_stat_t;
+
+/* Fill in the counters of up to n caches, oldest first. Returns the
+ * number of caches there are, which may be more than n. */
+size_t mem_cache_stats(mem_cache_stat_t *stats, size_t n);
+
+/* Print the counters of every cache, one line each. */
+void mem_cache_dump(void);
+
 /* === General Purpose Allocation ===
  *
  * These allocation routines are suitable for on-demand allocation of
@@ -62,16 +95,53 @@ __test void vma_test(void);
  */
 
 /* Allocate `size' bytes of memory from the kernel heap with the given
- * memory flags. Returns null on failure (i.e. insufficient memory). */
+ * memory flags. Returns null on failure (i.e. insufficient memory).
+ * With M_DMA the memory is physically contiguous and in the DMA zone;
+ * such allocations cannot be larger than the largest kmalloc cache. */
 void *kmalloc (unsigned long size, mflags_t flags);
 /* Free the memory at the given address. Assumes that `addr' was
  * returned by kmalloc(); if it wasn't, bad things will happen. */
 void  kfree (void *addr);
 /* Adjust the allocation record for `addr' to the given size and flags.
  * Returns the new address (which is not necessarily the same as the
- * old address), or null on failure. */
+ * old address), or null on failure. The address stays the same if the
+ * size class does not change, or if a big allocation can be resized in
+ * place. Growth is only zero-filled if the allocation and every
+ * krealloc of it passed M_ZERO. */
 void *krealloc(void *addr, unsigned long size, mflags_t flags);
 
+/* === Virtually Contiguous Allocation ===
+ *
+ * vmalloc maps single pages into the vmalloc range, so that large
+ * allocations need not be physically contiguous and are not rounded up
+ * to a power of two pages. kmalloc hands anything that no kmalloc
+ * cache fits to vmalloc. The memory must not be used for DMA.
+ */
+
+/* Set up vmalloc. Called by vma_init(). */
+void vmalloc_init(void);
+/* Report the pages and areas in use. */
+void vmalloc_report(void);
+__test void vmalloc_test(void);
+
+/* Allocate `size' bytes, rounded up to whole pages, with the given
+ * memory flags. Returns null on failure. */
+void *vmalloc(unsigned long size, mflags_t flags);
+/* Free an area returned by vmalloc(). */
+void  vfree(void *addr);
+/* Resize the area at `addr' to `size' bytes without moving it. Returns
+ * false, changing nothing, if the area cannot grow where it is. */
+bool  vresize(void *addr, unsigned long size, mflags_t flags);
+/* The size in bytes of the area at `addr', or 0 if it is not one. */
+unsigned long vmalloc_size(const void *addr);
+
+/* True if `addr' lies in the vmalloc range. */
+static inline bool
+is_vmalloc_addr(const void *addr)
+{
+        return (vaddr_t)addr - KERN_VMAP_BASE < KERN_VMAP_SZ;
+}
+
 /* === Memory Caches ===
  *
  * For objects that are frequently allocated and deallocated, it is
@@ -94,6 +164,9 @@ void *krealloc(void *addr, unsigned long size, mflags_t flags);
  *      flags - A set of flags to apply to the cache.
  *      ctor - An optional routine to call on any object to be alloc'd.
  *      dtor - An optional routine to call on any freed object.
+ * A cache with neither a ctor nor a dtor may share the slabs of an
+ * existing cache of the same object size and alignment (see
+ * SLAB_CACHE_NOMERGE).
  */
 mem_cache_t *mem_cache_create(const char *name, size_t size,
                               size_t align, mem_cache_flags_t flags,
@@ -101,14 +174,25 @@ mem_cache_t *mem_cache_create(const char *name, size_t size,
                               void (*dtor)(void *, size_t));
 
 /* Destroy the given memory cache. Returns 0 on success or 1 on
- * failure (e.g. if the cache is still in use). */
+ * failure (e.g. if the cache is still in use, or other caches have
+ * been merged into it). */
 int mem_cache_destroy(mem_cache_t *cp);
 
 /* Allocate an object from the given memory cache.
  * 'flags' should *not* have M_HIGH set. */
 void *mem_cache_alloc(mem_cache_t *cp, mflags_t flags);
 
+/* Allocate n objects from the given memory cache into objs. Either
+ * all of them are allocated and 0 is returned, or none are and 1 is
+ * returned. Cheaper than n calls to mem_cache_alloc. */
+int mem_cache_alloc_bulk(mem_cache_t *cp, mflags_t flags, size_t n,
+                         void **objs);
+
 /* Free an object from the given memory cache. */
 void mem_cache_free(mem_cache_t *cp, void *obj);
 
+/* Free the n objects in objs, none of which may be NULL, to the given
+ * memory cache. */
+void mem_cache_free_bulk(mem_cache_t *cp, size_t n, void **objs);
+
 #endif
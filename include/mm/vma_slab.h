@@ -38,46 +38,87 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #define CACHE_NAMELEN 255
 #define SLAB_MAX_OBJS 512 /* Max number of objects per slab. */
 
-// TODO Use me
+/* SLAB_CACHE_DMA caches take their slabs from the DMA zone, whatever
+ * flags an allocation is made with. */
 #define SLAB_CACHE_DMA_BIT      0
-// TODO Use me
 #define SLAB_CACHE_NOREAP_BIT   1
 #define SLAB_CACHE_SLABOFF_BIT  2
+#define SLAB_CACHE_NOMAG_BIT    3
+#define SLAB_CACHE_NOMERGE_BIT  4
 
 #define SLAB_CACHE_DMA          (1 << SLAB_CACHE_DMA_BIT)
 #define SLAB_CACHE_NOREAP       (1 << SLAB_CACHE_NOREAP_BIT)
 #define SLAB_CACHE_SLABOFF      (1 << SLAB_CACHE_SLABOFF_BIT)
+#define SLAB_CACHE_NOMAG        (1 << SLAB_CACHE_NOMAG_BIT)
+#define SLAB_CACHE_NOMERGE      (1 << SLAB_CACHE_NOMERGE_BIT)
 
-#define SLAB_CACHE_GOODFLAGS (GENMASK(2,0))
+#define SLAB_CACHE_GOODFLAGS (GENMASK(4,0))
 
 typedef unsigned int mem_cache_flags_t;
 
+/* Freed objects are kept in per-CPU magazines (Bonwick & Adams,
+ * "Magazines and Vmem"), so that most allocations and frees never get
+ * as far as the slab lists. Each CPU has a loaded and a previous
+ * magazine of up to SLAB_MAG_ROUNDS objects, and trades whole
+ * magazines with the depot of the cache when both run full or empty.
+ *
+ * Caches with SLAB_CACHE_NOMAG go straight to the slabs. */
+#define SLAB_MAG_ROUNDS 15
+#define SLAB_MAX_CPUS   8       /* CPUs beyond this skip the magazines */
+
+struct slab_mag;
+
+typedef struct {
+        struct slab_mag   *loaded;
+        struct slab_mag   *previous;
+} slab_cpu_t;
+
+/* Caches without a ctor or dtor are merged into an existing cache with
+ * the same object size, slots and flags, rather than getting slabs of
+ * their own. The merged cache keeps its name and its counters, while
+ * its objects come from the cache it was merged into. Caches flagged
+ * SLAB_CACHE_NOMERGE, the kmalloc caches among them, always get their
+ * own slabs and are never merged into. */
 typedef struct mem_cache {
         char               name[CACHE_NAMELEN + 1];
         unsigned long      obj_size;
         unsigned long      pf_order;
         unsigned long      align;
         unsigned int       num;
-        unsigned long      refct;
+        unsigned long      refct;       /* Caches merged into this one */
+        struct mem_cache  *merged;      /* The cache that holds our slabs */
         unsigned int       grown;
         unsigned long      wastage;
+        unsigned long      colors;      /* Offsets to start slabs at */
+        unsigned long      color_next;  /* Offset of the next slab */
         unsigned long      big_bused;
+        unsigned long      nr_empty;    /* Slabs on slabs_empty */
+        unsigned long      nr_allocs;   /* Objects handed out, ever */
+        unsigned long      nr_frees;    /* Objects given back, ever */
+        unsigned long      nr_grows;    /* Slabs created */
+        unsigned long      nr_reaps;    /* Empty slabs destroyed */
         mem_cache_flags_t flags;
 
         struct list_head   cache_list;
         struct list_head   slabs_full;
         struct list_head   slabs_partial;
         struct list_head   slabs_empty;
-
-#define SLAB_NUM_BUCKETS 113
-        struct list_head   slab_map[SLAB_NUM_BUCKETS];
+        struct list_head   shrink_list; /* On the shrinker's list */
 
         void (*obj_ctor)(void *, size_t);
         void (*obj_dtor)(void *, size_t);
+
+        slab_cpu_t         cpus[SLAB_MAX_CPUS];
+        struct list_head   mags_full;   /* The depot */
+        struct list_head   mags_empty;
+        unsigned long      nr_mags_full;
 } mem_cache_t;
 
-void
-slab_reap(void);
+/* Destroy empty slabs, coldest first, until about 'nr' pages have been
+ * freed. Caches flagged SLAB_CACHE_NOREAP are left alone. Returns the
+ * number of pages freed. */
+unsigned long
+slab_shrink(unsigned long nr);
 
 #define SLAB_KMALLOC_MAX_ORD 14
 
@@ -70,4 +70,8 @@ void vmobject_destroy(vmobject_t *);
 // Adds the given page to the vmobject's owned linked-list.
 void vmobject_add_page(vmobject_t *, page_t *);
 
+// Puts 'pg' in the place of 'old' in the vmobject's owned linked-list,
+// and lets go of 'old'. Returns 1 if the object does not own 'old'.
+int vmobject_replace_page(vmobject_t *, page_t *old, page_t *pg);
+
 #endif
@@ -38,6 +38,8 @@ THE POSSIBILITY OF SUCH DAMAGE.
 
 #define SYS_MAXARGS 6
 
+struct mem_cache_stat;
+
 typedef struct {
         const char *const name;
         size_t num_args;
@@ -56,5 +58,6 @@ typedef struct {
 
 SYSCALL(exit, int status);  // 0
 SYSCALL(fork); // 1
+SYSCALL(slabinfo, struct mem_cache_stat *buf, size_t n); // 2
 
 #endif
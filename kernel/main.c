@@ -34,6 +34,7 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #include <machine/irq.h>
 #include <machine/regs.h>
 #include <machine/tty.h>
+#include <mm/mempool.h>
 #include <mm/paging.h>
 #include <mm/pfa.h>
 #include <mm/pmm.h>
@@ -131,12 +132,19 @@ main(multiboot_info_t *mbd)
          * control block with it */
         cpu_init_early();
 
+        /* With a CPU control block, the PFA can use its per-CPU page
+         * caches. */
+        pfa_init_late();
+
         /* Set up the VMA */
         vma_init();
         DO_TEST(vma_test);
+        DO_TEST(vmalloc_test);
+        DO_TEST(mempool_test);
 
         /* Now we can use the VMA to get the full PMM subsystem going. */
         pmm_init_late();
+        DO_TEST(pmm_test);
 
         /* Okay, now we can get some symbols. */
         ksyms_init(mbd);
@@ -221,9 +229,9 @@ stub_init(void)
         const size_t size = 0x1000;
 
         vmobject_t *code_obj = vmobject_create_anon(size, PFLAGS_RX);
-        page_t *code_page = pfa_alloc(M_USER);
+        page_t *code_page = pfa_alloc_colored(M_USER, 0, code_addr);
         vmobject_t *stack_obj = vmobject_create_anon(size, PFLAGS_RW);
-        page_t *stack_page = pfa_alloc(M_USER);
+        page_t *stack_page = pfa_alloc_colored(M_USER, 0, stack_addr);
         panic_on(!code_obj || !stack_obj || !code_page || !stack_page,
                         "Failed to allocate initial regions");
         vmobject_add_page(code_obj, code_page);
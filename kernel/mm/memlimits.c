@@ -35,17 +35,102 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #include <sys/kprintf.h>
 #include <sys/stdio.h>
 #include <sys/panic.h>
+#include <sys/size.h>
 #include <util/cmp.h>
 
 /* The linker should provide this, the address of which will be the
  * first byte after the end of the kernel image. */
 extern char kernel_end;
 
+/* Multiboot memory map entries of this type are usable RAM. */
+#define MMAP_TYPE_RAM 1
+
+/* We can only address physical memory up to here. */
+#if WORD_SIZE == 32
+#define PHYS_MAX_PFN ((size_t)1 << (32 - PAGE_SHIFT))
+#else
+#define PHYS_MAX_PFN ((size_t)-1 >> PAGE_SHIFT)
+#endif
+
+void
+memlimits_add_region(memlimits_t *lim, size_t start_pfn, size_t end_pfn)
+{
+        unsigned int i, j;
+
+        if (start_pfn >= end_pfn)
+                return;
+
+        /* Find the first region that ends at or after this one starts. */
+        for (i = 0; i < lim->nr_regions; i++)
+        {
+                if (lim->regions[i].end_pfn >= start_pfn)
+                        break;
+        }
+        if (i < lim->nr_regions && lim->regions[i].start_pfn <= end_pfn) {
+                /* Overlapping or adjacent; grow the region, then absorb
+                 * any of its successors that now overlap it. */
+                memregion_t *r = &lim->regions[i];
+                r->start_pfn = MIN(r->start_pfn, start_pfn);
+                r->end_pfn   = MAX(r->end_pfn, end_pfn);
+                j = i + 1;
+                while (j < lim->nr_regions &&
+                       lim->regions[j].start_pfn <= r->end_pfn)
+                {
+                        r->end_pfn = MAX(r->end_pfn, lim->regions[j].end_pfn);
+                        j++;
+                }
+                /* Close the gap left by the absorbed regions. */
+                for (i = i + 1; j < lim->nr_regions; i++, j++)
+                        lim->regions[i] = lim->regions[j];
+                lim->nr_regions = i;
+                return;
+        }
+
+        if (lim->nr_regions == MEMLIMITS_MAX_REGIONS) {
+                kprintf(0, "Too many memory regions; ignoring "
+                           PFMT" - "PFMT"\n",
+                           paddr_of(start_pfn), paddr_of(end_pfn));
+                return;
+        }
+        for (j = lim->nr_regions; j > i; j--)
+                lim->regions[j] = lim->regions[j - 1];
+        lim->regions[i].start_pfn = start_pfn;
+        lim->regions[i].end_pfn   = end_pfn;
+        lim->nr_regions++;
+}
+
+static void
+parse_mmap(memlimits_t *to, multiboot_info_t *mbd)
+{
+        vaddr_t addr = KERN_BASE + mbd->mmap_addr;
+        vaddr_t end  = addr + mbd->mmap_length;
+
+        while (addr < end)
+        {
+                memory_map_t *mm = (memory_map_t *)addr;
+                uint64_t base = ((uint64_t)mm->base_addr_high << 32)
+                              | mm->base_addr_low;
+                uint64_t len  = ((uint64_t)mm->length_high << 32)
+                              | mm->length_low;
+                /* The size field does not count itself. */
+                addr += mm->size + sizeof(mm->size);
+
+                if (mm->type != MMAP_TYPE_RAM)
+                        continue;
+                if (PFN_UP(base) >= PHYS_MAX_PFN)
+                        continue;
+                memlimits_add_region(to, PFN_UP(base),
+                        MIN(PFN_DOWN(base + len), PHYS_MAX_PFN));
+        }
+}
+
 void
 detect_memory_limits(memlimits_t *to, multiboot_info_t *mbd)
 {
-        size_t start_pfn, max_pfn;
+        size_t start_pfn, low_top, free_pages;
         vaddr_t last_address = (vaddr_t)&kernel_end;
+        memregion_t *kr = NULL;
+        unsigned int i;
 
         if (!mbd || !(mbd->flags & 1)) {
                 // TODO manual memory map
@@ -56,7 +141,6 @@ detect_memory_limits(memlimits_t *to, multiboot_info_t *mbd)
         if (mbd->flags & (1<<5)) {
                 /* There are ELF headers present which we ought to
                  * preserve. */
-                unsigned int i;
                 Elf_Shdr *sh = (void *)(KERN_BASE + mbd->u.elf_sec.addr);
                 for (i = 0; i < mbd->u.elf_sec.num; i++)
                 {
@@ -71,19 +155,49 @@ detect_memory_limits(memlimits_t *to, multiboot_info_t *mbd)
                 }
         }
 
+        to->nr_regions = 0;
+        if (mbd->flags & (1<<6)) {
+                parse_mmap(to, mbd);
+        } else {
+                /* No map; all we know is that there is conventional
+                 * memory, and some amount of memory above 1MiB. */
+                memlimits_add_region(to, 0, PFN_DOWN(1024ULL *
+                                                     mbd->mem_lower));
+                memlimits_add_region(to, PFN_DOWN(MB),
+                        PFN_DOWN(MB + 1024ULL * mbd->mem_upper));
+        }
+        bug_on(to->nr_regions == 0, "No usable memory.");
+
         start_pfn = PFN_UP(_pa(last_address)); /* Next free page */
-        max_pfn   = PFN_DOWN(1024ULL * mbd->mem_upper);
+
+        /* Low memory is taken from the region that the kernel was
+         * loaded into, since it has to be contiguous. */
+        for (i = 0; i < to->nr_regions; i++)
+        {
+                if (to->regions[i].start_pfn <= start_pfn &&
+                    start_pfn < to->regions[i].end_pfn) {
+                        kr = &to->regions[i];
+                        break;
+                }
+        }
+        panic_on(!kr, "Kernel not loaded into usable memory.");
 
         /* Determine how much free memory we have for DMA, the kernel,
          * and the user.
          * We allocate 1/4 of physical memory after the end of the
-         * kernel image to the kernel and 3/4 to the user. Everything
-         * before KERN_OFFS is allocated as DMA. */
-        to->dma_pfn = 1;
+         * kernel image to the kernel and 3/4 to the user, as long as
+         * the kernel's part fits in the region it was loaded into and
+         * in the kernel's linear mapping. Everything before KERN_OFFS
+         * is allocated as DMA. */
+        to->max_pfn = to->regions[to->nr_regions - 1].end_pfn;
+        free_pages  = range_pages_avail(to, start_pfn, to->max_pfn);
+        low_top     = MIN(kr->end_pfn, LOWMEM_MAX_PFN);
+        low_top     = MIN(low_top, start_pfn + (free_pages >> 2));
+
+        to->dma_pfn = MAX(to->regions[0].start_pfn, 1);
         to->dma_pfn_end  = (KERN_OFFS / PAGE_SIZE);
         to->low_pfn  = start_pfn;
-        to->high_pfn = start_pfn + ((max_pfn - start_pfn) >> 2);
-        to->max_pfn  = max_pfn;
+        to->high_pfn = low_top;
 
         bug_on(to->dma_pfn_end >= to->low_pfn,
                         "Insufficient DMA memory.");
@@ -96,13 +210,19 @@ detect_memory_limits(memlimits_t *to, multiboot_info_t *mbd)
 void
 limits_report(memlimits_t *limits)
 {
+        unsigned int i;
         char buf[80];
         banner(buf, sizeof(buf), 12 + 4 + (WORD_SIZE / 2), '=',
                " Memory Available ");
         kprintf(0, "%s\n", buf);
+        for (i = 0; i < limits->nr_regions; i++)
+        {
+                kprintf(0, "["PFMT " - " PFMT "]    ram\n",
+                           paddr_of(limits->regions[i].start_pfn),
+                           paddr_of(limits->regions[i].end_pfn));
+        }
         kprintf(0, "["PFMT " - " PFMT "] kernel\n"
                    "["PFMT " - " PFMT "]   user\n",
                    _va(lowmem_base(limits)), _va(lowmem_top(limits)),
                    highmem_base(limits), highmem_top(limits));
 }
-
@@ -0,0 +1,238 @@
+/*
+Copyright (c) 2016, James Sullivan <sullivan.james.f@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote
+      products derived from this software without specific prior
+      written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER>
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * mm/mempool.c
+ *
+ * Reserves of pre-allocated objects for paths that have to make
+ * progress under memory pressure (see mm/mempool.h).
+ */
+
+#include <mm/mempool.h>
+#include <mm/pfa.h>
+#include <mm/vma.h>
+#include <sys/config.h>
+#include <sys/kprintf.h>
+#include <sys/panic.h>
+#include <sys/string.h>
+
+#ifdef CONF_DEBUG
+/* Set by mempool_test to make the cache look out of memory. */
+static bool mempool_test_fail;
+#endif
+
+static void *
+pool_get(mempool_t *pool, mflags_t flags)
+{
+#ifdef CONF_DEBUG
+        if (mempool_test_fail)
+                return NULL;
+#endif
+        if (pool->cache)
+                return mem_cache_alloc(pool->cache, flags);
+        return pfa_alloc(flags);
+}
+
+static void
+pool_put(mempool_t *pool, void *obj)
+{
+        if (pool->cache)
+                mem_cache_free(pool->cache, obj);
+        else
+                pfa_free((page_t *)obj);
+}
+
+mempool_t *
+mempool_create(mem_cache_t *cp, unsigned long min)
+{
+        mempool_t *pool;
+
+        pool = kmalloc(sizeof(*pool) + min * sizeof(void *), M_KERNEL);
+        if (!pool)
+                return NULL;
+        pool->cache = cp;
+        pool->min = min;
+        pool->nr = 0;
+        pool->nr_drawn = 0;
+        while (pool->nr < min) {
+                void *obj = pool_get(pool, M_KERNEL);
+                if (!obj) {
+                        mempool_destroy(pool);
+                        return NULL;
+                }
+                pool->reserve[pool->nr++] = obj;
+        }
+        return pool;
+}
+
+void
+mempool_destroy(mempool_t *pool)
+{
+        if (!pool)
+                return;
+        while (pool->nr > 0)
+                pool_put(pool, pool->reserve[--pool->nr]);
+        kfree(pool);
+}
+
+void *
+mempool_alloc(mempool_t *pool, mflags_t flags)
+{
+        void *obj, *spare;
+
+        obj = pool_get(pool, flags);
+        if (obj) {
+                /* Memory is to be had again, so make up for an
+                 * earlier draw on the reserve. */
+                if (pool->nr < pool->min &&
+                    (spare = pool_get(pool, flags & ~M_ZERO)))
+                        pool->reserve[pool->nr++] = spare;
+                return obj;
+        }
+        if (pool->nr == 0)
+                return NULL;
+
+        /* Reserved objects were constructed when they were set aside,
+         * so only M_ZERO is left to do. Whatever the constructor set up
+         * has to be torn down before it is zeroed away. */
+        obj = pool->reserve[--pool->nr];
+        pool->nr_drawn++;
+        if (pool->cache && (flags & M_ZERO)) {
+                mem_cache_t *cp = pool->cache;
+
+                if (cp->obj_dtor)
+                        cp->obj_dtor(obj, cp->obj_size);
+                memset(obj, 0, cp->obj_size);
+                if (cp->obj_ctor)
+                        cp->obj_ctor(obj, cp->obj_size);
+        }
+        return obj;
+}
+
+void
+mempool_free(mempool_t *pool, void *obj)
+{
+        mem_cache_t *cp = pool->cache;
+
+        if (!obj)
+                return;
+        if (pool->nr >= pool->min) {
+                pool_put(pool, obj);
+                return;
+        }
+        /* Leave the object as the cache would hand it out. */
+        if (cp && cp->obj_dtor)
+                cp->obj_dtor(obj, cp->obj_size);
+        if (cp && cp->obj_ctor)
+                cp->obj_ctor(obj, cp->obj_size);
+        if (!cp)
+                ((page_t *)obj)->flags &= ~PG_ZERO;
+        pool->reserve[pool->nr++] = obj;
+}
+
+#ifdef CONF_DEBUG
+static unsigned long mempool_test_ctor_calls, mempool_test_dtor_calls;
+
+static void
+mempool_test_ctor(__attribute__((unused)) void *p,
+                  __attribute__((unused)) size_t sz)
+{
+        mempool_test_ctor_calls++;
+}
+
+static void
+mempool_test_dtor(__attribute__((unused)) void *p,
+                  __attribute__((unused)) size_t sz)
+{
+        mempool_test_dtor_calls++;
+}
+#endif
+
+__test void
+mempool_test(void)
+{
+#ifdef CONF_DEBUG
+        mem_cache_t *cp;
+        mempool_t *pool;
+        void *objs[2];
+
+        cp = mem_cache_create("mempool!", 48, 0,
+                              SLAB_CACHE_NOMAG | SLAB_CACHE_NOMERGE,
+                              mempool_test_ctor, mempool_test_dtor);
+        bug_on(!cp, "mem_cache_create failed");
+        pool = mempool_create(cp, 2);
+        bug_on(!pool || pool->nr != 2, "Reserve not filled");
+
+        /* With memory to spare, the reserve is left alone. */
+        objs[0] = mempool_alloc(pool, M_KERNEL);
+        bug_on(!objs[0] || pool->nr != 2 || pool->nr_drawn,
+               "Reserve used while the cache had objects");
+        mempool_free(pool, objs[0]);
+        bug_on(pool->nr != 2, "Reserve overfilled");
+
+        /* Once the cache fails, the reserve takes over until it runs
+         * out. An M_ZERO object is torn down before it is rebuilt. */
+        mempool_test_fail = true;
+        mempool_test_ctor_calls = mempool_test_dtor_calls = 0;
+        objs[0] = mempool_alloc(pool, M_ATOMIC | M_ZERO);
+        objs[1] = mempool_alloc(pool, M_ATOMIC);
+        bug_on(!objs[0] || !objs[1] || pool->nr_drawn != 2,
+               "Reserve not used");
+        bug_on(mempool_test_ctor_calls != 1 || mempool_test_dtor_calls != 1 ||
+               ((char *)objs[0])[47], "Reserved object not set up for M_ZERO");
+        bug_on(mempool_alloc(pool, M_ATOMIC), "Empty reserve gave more");
+
+        /* Frees refill the reserve first, and so does the next
+         * allocation once memory comes back. */
+        mempool_free(pool, objs[1]);
+        bug_on(pool->nr != 1, "Free did not refill the reserve");
+        mempool_test_fail = false;
+        objs[1] = mempool_alloc(pool, M_KERNEL);
+        bug_on(!objs[1] || pool->nr != 2, "Reserve not topped up");
+        mempool_free(pool, objs[0]);
+        mempool_free(pool, objs[1]);
+        mempool_destroy(pool);
+        bug_on(mem_cache_destroy(cp), "Failed to destroy cache");
+
+        /* Pools of pages work the same way. */
+        pool = mempool_create(NULL, 1);
+        bug_on(!pool || pool->nr != 1, "Page reserve not filled");
+        mempool_test_fail = true;
+        objs[0] = mempool_alloc(pool, M_ATOMIC);
+        bug_on(!objs[0] || pool->nr_drawn != 1, "Page reserve not used");
+        bug_on(mempool_alloc(pool, M_ATOMIC), "Empty page reserve gave more");
+        mempool_test_fail = false;
+        mempool_free(pool, objs[0]);
+        mempool_destroy(pool);
+
+        kprintf(0, "mempool_test passed\n");
+#endif
+}
@@ -39,6 +39,7 @@ THE POSSIBILITY OF SUCH DAMAGE.
  */
 
 #include <asm/bitops.h>
+#include <machine/cpu.h>
 #include <mm/flags.h>
 #include <mm/memlimits.h>
 #include <mm/reserve.h>
@@ -51,278 +52,1192 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #include <sys/string.h>
 #include <sys/stdio.h>
 #include <sys/size.h>
+#include <sys/sysinit.h>
 #include <sys/panic.h>
+#include <sys/proc.h>
+#include <sys/timer.h>
 #include <util/cmp.h>
 #include <util/list.h>
 #include <util/math.h>
 
-pfa_t pfa = { .ready = false };
+pfa_t pfa = { .ready = false, .pcp_ready = false };
 
-static inline unsigned int
-order_of(unsigned long num_pages)
-{
-        return LOG2(num_pages);
-}
+static PERCPU_DEFINE(pfa_pcpu_t, pfa_pcpu);
+
+static pfa_migrate_t pfa_migrate = NULL;
+static timer_t pfa_timer;
+static LIST_HEAD(reclaimers);
 
 static void
 mark_avail(page_t *pg)
 {
-        unsigned long ind = PFA_MAP_INDEX(page_to_phys(pg));
-        _clr_bit(pfa.tag_bits, ind);
+        pg->flags |= PG_BUDDY;
 }
 
 static void
 mark_allocated(page_t *pg)
 {
-        unsigned long ind = PFA_MAP_INDEX(page_to_phys(pg));
-        _set_bit(pfa.tag_bits, ind);
+        pg->flags &= ~PG_BUDDY;
 }
 
 static bool
 is_avail(page_t *pg)
 {
-        unsigned long ind = PFA_MAP_INDEX(page_to_phys(pg));
-        return (bool)(!_tst_bit(pfa.tag_bits, ind));
+        return (pg->flags & PG_BUDDY) != 0;
 }
 
-void
-pfa_init(memlimits_t *limits)
+/* Forget what the frames from pfn were last used for. The owner that
+ * page_t keeps in a union (a slab, a vmalloc area or a share count)
+ * is only good while the frames stay with it. */
+static void
+clear_owner(unsigned long pfn, unsigned long npages)
 {
-        unsigned long pages_npg;
-        unsigned long tag_bits_phys;
-        unsigned long tag_bits_npg;
-        unsigned long dma_pages;
-        unsigned long low_pages;
-        unsigned long high_pages;
-        unsigned long all_pages;
-        unsigned long pages_sz;
         unsigned long i;
-        paddr_t pages_phys;
 
+        for (i = 0; i < npages; i++)
+                pfn_to_page(pfn + i)->shared = 0;
+}
 
-        bug_on(!limits, "NULL limits");
-        pfa.limits = limits;
+static void
+zone_add_block(pfa_zone_t *z, page_t *pg, unsigned int order)
+{
+        pfa_block_t *b = &z->blocks[order];
+
+        pg->order = order;
+        mark_avail(pg);
+        list_add(&b->list, &pg->list);
+        if (b->nr_free++ == 0)
+                _set_bit(&z->order_map, order);
+        z->nr_free_pages += 1UL << order;
+}
 
-        all_pages  = limits->max_pfn;
-        pages_sz = (all_pages * sizeof(page_t));
+static void
+zone_del_block(pfa_zone_t *z, page_t *pg, unsigned int order)
+{
+        pfa_block_t *b = &z->blocks[order];
 
-        /* First of all, get some room for our global page list. */
-        pages_npg = ((PAGE_SIZE - 1 + pages_sz) / PAGE_SIZE);
-        pages_phys = reserve_low_pages(limits, pages_npg);
-        pfa.pages = (page_t *)_va(pages_phys);
-        bug_on(pmm_map_range(&init_pmm, (vaddr_t)pfa.pages, pages_npg,
-                             pages_phys, M_ZERO | M_KERNEL, PFLAGS_RW),
-                "Failed to map pagelist to virtual address.");
+        list_del(&pg->list);
+        mark_allocated(pg);
+        if (--b->nr_free == 0)
+                _clr_bit(&z->order_map, order);
+        z->nr_free_pages -= 1UL << order;
+}
 
-        /* Do the same for our tag bits. */
-        tag_bits_npg = ((PAGE_SIZE - 1 + (all_pages >> 3)) / PAGE_SIZE);
-        tag_bits_phys = reserve_low_pages(limits, tag_bits_npg);
-        pfa.tag_bits = (unsigned long *)_va(tag_bits_phys);
-        bug_on(pmm_map_range(&init_pmm, (vaddr_t)pfa.tag_bits,
-                             tag_bits_npg, tag_bits_phys, M_ZERO | M_KERNEL,
-                             PFLAGS_RW),
-                "Failed to map tag bits to virtual address.");
+/* Carve [pfn, end) into the largest naturally aligned blocks that fit
+ * and put them on the given free lists. */
+static void
+free_range(pfa_zone_t *z, unsigned long pfn, unsigned long end)
+{
+        while (pfn < end)
+        {
+                unsigned int ord = PFA_MAX_PAGE_ORDER - 1;
+                while (ord > 0 &&
+                       ((pfn & ((1UL << ord) - 1)) || pfn + (1UL << ord) > end))
+                        ord--;
 
-        for (i = 0; i < all_pages; i++) {
-                list_head_init(&pfa.pages[i].list);
+                page_t *pg = pfn_to_page(pfn);
+                pg->vaddr = 0;
+                zone_add_block(z, pg, ord);
+
+                pfn += 1UL << ord;
         }
+}
 
-        /* Initialize the free page lists */
-        for (i = 0; i < PFA_MAX_PAGE_ORDER; i++)
+/* Put the RAM in [start, end) on the given free lists, skipping any
+ * holes. */
+static void
+free_ram(pfa_zone_t *z, unsigned long start, unsigned long end)
+{
+        unsigned int i;
+        for (i = 0; i < pfa.limits->nr_regions; i++)
         {
-                list_head_init(&pfa.dma_zones[i].list);
-                list_head_init(&pfa.low_zones[i].list);
-                list_head_init(&pfa.high_zones[i].list);
+                memregion_t *r = &pfa.limits->regions[i];
+                free_range(z, MAX(start, r->start_pfn),
+                           MIN(end, r->end_pfn));
         }
+}
 
-        dma_pages  = dma_pages_avail(limits);
-        low_pages  = lowmem_pages_avail(limits);
-        high_pages = highmem_pages_avail(limits);
+/* The zone that a page frame belongs to at boot. */
+static pfa_zone_id_t
+zone_of_pfn(unsigned long pfn)
+{
+        if (pfn < pfa.limits->dma_pfn_end)
+                return PFA_ZONE_DMA;
+        else if (pfn < pfa.limits->high_pfn)
+                return PFA_ZONE_LOW;
+        return PFA_ZONE_HIGH;
+}
 
-        /* Populate the free zone lists */
-        unsigned long ind = limits->dma_pfn;
-        i = 0;
-        while (i < dma_pages)
-        {
-                unsigned long next_block_size, ord;
-                if (dma_pages - i == 1) {
-                        next_block_size = 1;
-                } else {
-                        next_block_size = MIN(1 << (PFA_MAX_PAGE_ORDER-1),
-                                              (dma_pages - i) >> 1);
-                }
-                ord = order_of(next_block_size);
+/* Bring the page structs of a section to a known state. Every page
+ * starts out allocated, so that reserved pages and holes are never
+ * coalesced into. */
+static void
+section_init(unsigned long sec)
+{
+        pfa_section_t *s = &pfa.sections[sec];
+        unsigned long base = sec << PFA_SECTION_ORDER;
+        unsigned long i;
 
-                bug_on(next_block_size == 0, "Infinite loop");
-                bug_on(ind >= dma_end(limits), "Exceeding dma page bounds");
-                bug_on(ord >= PFA_MAX_PAGE_ORDER, "Invalid zone order");
+        if (s->ready || !s->pages)
+                return;
+        bzero(s->pages, PFA_SECTION_PAGES * sizeof(page_t));
+        for (i = 0; i < PFA_SECTION_PAGES; i++) {
+                s->pages[i].flags = (sec << PG_SECTION_SHIFT)
+                        | ((unsigned long)zone_of_pfn(base + i)
+                           << PG_ZONE_SHIFT);
+                list_head_init(&s->pages[i].list);
+        }
+        s->ready = true;
+}
 
-                page_t *pg = &pfa.pages[ind];
-                pg->order = ord;
-                pg->vaddr = 0;
-                list_add(&pfa.dma_zones[ord].list, &pg->list);
+/* Initialize the next deferred section of a zone and put its pages on
+ * the free lists. Returns false if the zone is fully initialized. */
+static bool
+zone_grow(pfa_zone_t *z)
+{
+        unsigned long start = z->init_pfn;
+        unsigned long end;
+        uint64_t t;
 
-                ind += next_block_size;
-                i += next_block_size;
-        }
-        ind = limits->low_pfn;
-        while (i < low_pages)
-        {
-                unsigned long next_block_size, ord;
-                if (low_pages - i == 1) {
-                        next_block_size = 1;
-                } else {
-                        next_block_size = MIN(1 << (PFA_MAX_PAGE_ORDER-1),
-                                              (low_pages - i) >> 1);
-                }
-                ord = order_of(next_block_size);
+        if (start >= z->end_pfn)
+                return false;
+        t = rdtsc();
+        end = MIN(z->end_pfn, (start + PFA_SECTION_PAGES) &
+                              ~(PFA_SECTION_PAGES - 1));
+        /* Sections shared with another zone may already be set up. */
+        section_init(start >> PFA_SECTION_ORDER);
+        free_ram(z, start, end);
+        z->init_pfn = end;
+        if (pfa.ready)
+                pfa.deferred_cycles += rdtsc() - t;
+        return true;
+}
 
-                bug_on(next_block_size == 0, "Infinite loop");
-                bug_on(ind >= lowmem_end(limits), "Exceeding low page bounds");
-                bug_on(ord >= PFA_MAX_PAGE_ORDER, "Invalid zone order");
+void
+pfa_init(memlimits_t *limits)
+{
+        unsigned long nr_sections, nr_present = 0;
+        unsigned long table_sz, table_npg;
+        unsigned long i;
+        paddr_t table_phys;
+        uint8_t *table;
+        uint64_t start = rdtsc();
 
-                page_t *pg = &pfa.pages[ind];
-                pg->order = ord;
-                pg->vaddr = 0;
-                list_add(&pfa.low_zones[ord].list, &pg->list);
+        bug_on(!limits, "NULL limits");
+        pfa.limits = limits;
 
-                ind += next_block_size;
-                i += next_block_size;
+        /* First of all, get some room for our section table and the
+         * page structs of each section that has RAM in it. */
+        nr_sections = (limits->max_pfn + PFA_SECTION_PAGES - 1)
+                      >> PFA_SECTION_ORDER;
+        for (i = 0; i < nr_sections; i++)
+        {
+                if (range_pages_avail(limits, i << PFA_SECTION_ORDER,
+                                      (i + 1) << PFA_SECTION_ORDER))
+                        nr_present++;
         }
-        ind = limits->high_pfn;
-        while (i < high_pages)
+        table_sz = nr_sections * sizeof(pfa_section_t)
+                 + nr_present * PFA_SECTION_PAGES * sizeof(page_t);
+        table_npg = PFN_UP(table_sz);
+        table_phys = reserve_low_pages(limits, table_npg);
+
+        /* The page structs are not zeroed when mapped, since most of
+         * them are initialized lazily. */
+        table = (uint8_t *)_va(table_phys);
+        bug_on(pmm_map_range(&init_pmm, (vaddr_t)table, table_npg,
+                             table_phys, M_KERNEL, PFLAGS_RW),
+                "Failed to map page structs to virtual address.");
+        pfa.sections = (pfa_section_t *)table;
+        table += nr_sections * sizeof(pfa_section_t);
+        for (i = 0; i < nr_sections; i++)
         {
-                unsigned long next_block_size, ord;
-                if (high_pages - i == 1) {
-                        next_block_size = 1;
-                } else {
-                        next_block_size = MIN(1 << (PFA_MAX_PAGE_ORDER-1),
-                                              (high_pages - i) >> 1);
-                }
-                ord = order_of(next_block_size);
+                pfa.sections[i].ready = false;
+                pfa.sections[i].pages = NULL;
+                if (!range_pages_avail(limits, i << PFA_SECTION_ORDER,
+                                       (i + 1) << PFA_SECTION_ORDER))
+                        continue;
+                pfa.sections[i].pages = (page_t *)table;
+                table += PFA_SECTION_PAGES * sizeof(page_t);
+        }
+        pfa.nr_sections = nr_sections;
 
-                bug_on(next_block_size == 0, "Infinite loop");
-                bug_on(ind >= highmem_end(limits), "Exceeding high page bounds");
-                bug_on(ord >= PFA_MAX_PAGE_ORDER, "Invalid zone order");
+        /* The page structs of reserved memory are never put on a free
+         * list, but are still looked up when the memory is mapped, so
+         * set those up right away. */
+        for (i = 0; i <= (limits->low_pfn >> PFA_SECTION_ORDER); i++)
+                section_init(i);
 
-                page_t *pg = &pfa.pages[ind];
-                pg->order = ord;
-                pg->vaddr = 0;
-                list_add(&pfa.high_zones[ord].list, &pg->list);
-
-                ind += next_block_size;
-                i += next_block_size;
+        /* Initialize the free page lists */
+        for (i = 0; i < PFA_NR_ZONES; i++)
+        {
+                unsigned int j;
+                for (j = 0; j < PFA_MAX_PAGE_ORDER; j++)
+                {
+                        list_head_init(&pfa.zones[i].blocks[j].list);
+                        pfa.zones[i].blocks[j].nr_free = 0;
+                }
+                pfa.zones[i].order_map = 0;
+                pfa.zones[i].nr_free_pages = 0;
+                list_head_init(&pfa.zones[i].zero_pages);
+                pfa.zones[i].nr_zero = 0;
+                for (j = 0; j < PFA_NR_COLORS; j++)
+                        list_head_init(&pfa.zones[i].color_pages[j]);
+                pfa.zones[i].nr_colored = 0;
+        }
+        pfa.zones[PFA_ZONE_DMA].init_pfn  = limits->dma_pfn;
+        pfa.zones[PFA_ZONE_DMA].end_pfn   = dma_end(limits);
+        pfa.zones[PFA_ZONE_LOW].init_pfn  = limits->low_pfn;
+        pfa.zones[PFA_ZONE_LOW].end_pfn   = lowmem_end(limits);
+        pfa.zones[PFA_ZONE_HIGH].init_pfn = limits->high_pfn;
+        pfa.zones[PFA_ZONE_HIGH].end_pfn  = highmem_end(limits);
+        for (i = 0; i < PFA_NR_ZONES; i++)
+        {
+                pfa_zone_t *z = &pfa.zones[i];
+                unsigned long min = range_pages_avail(limits, z->init_pfn,
+                                                      z->end_pfn) >> 7;
+                z->nr_borrowed = z->nr_lent = z->nr_fallback = 0;
+                z->nr_throttled = 0;
+                /* Keep under 1% of the zone in reserve, and at least
+                 * a full per-CPU cache worth. */
+                min = MAX(min, (unsigned long)PFA_PCP_HIGH);
+                z->wmark[PFA_WMARK_MIN]  = min;
+                z->wmark[PFA_WMARK_LOW]  = min + min / 4;
+                z->wmark[PFA_WMARK_HIGH] = min + min / 2;
         }
 
+        /* Populate the free zone lists with just enough memory to get
+         * the kernel going. */
+        while (zone_grow(&pfa.zones[PFA_ZONE_DMA]))
+                ;
+        zone_grow(&pfa.zones[PFA_ZONE_LOW]);
+
         /* Once we hit the buddy allocator, we may not do any early
          * page reserving. */
         disable_reserve();
 
         pfa.ready = true;
+        pfa.boot_cycles = rdtsc() - start;
 }
 
+int
+pfa_init_deferred(void)
+{
+        unsigned long npages = 0;
+        unsigned int i;
+        uint64_t start = rdtsc();
+
+        for (i = 0; i < PFA_NR_ZONES; i++)
+        {
+                pfa_zone_t *z = &pfa.zones[i];
+                npages += range_pages_avail(pfa.limits, z->init_pfn,
+                                            z->end_pfn);
+                while (zone_grow(z))
+                        ;
+        }
+        pfa.deferred_cycles += rdtsc() - start;
+        kprintf(0, "pfa: %d deferred pages initialized "
+                   "(%d kcycles at boot, %d kcycles deferred)\n",
+                   npages, (unsigned long)(pfa.boot_cycles / 1000),
+                   (unsigned long)(pfa.deferred_cycles / 1000));
+        return 0;
+}
+SYSINIT_STEP("pfa_deferred", pfa_init_deferred, SYSINIT_EARLY, 0);
+
 bool
 pfa_ready(void)
 {
         return pfa.ready;
 }
 
-/* TODO handle discontiguous allocation? */
-page_t *
-pfa_alloc_pages(mflags_t flags, unsigned int order)
+static pfa_zone_id_t
+zone_of_flags(mflags_t flags)
+{
+        if (flags & M_DMA)
+                return PFA_ZONE_DMA;
+        else if (flags & M_HIGH)
+                return PFA_ZONE_HIGH;
+        return PFA_ZONE_LOW;
+}
+
+static pfa_zone_id_t
+zone_of_page(page_t *p)
+{
+        return (p->flags & PG_ZONE_MASK) >> PG_ZONE_SHIFT;
+}
+
+/* Hand every page of a block over to another zone. */
+static void
+block_set_zone(page_t *pg, unsigned int order, pfa_zone_id_t zone)
+{
+        unsigned long i;
+        for (i = 0; i < (1UL << order); i++)
+        {
+                pg[i].flags &= ~PG_ZONE_MASK;
+                pg[i].flags |= (unsigned long)zone << PG_ZONE_SHIFT;
+        }
+}
+
+/* The zone that a zone borrows memory from, or PFA_NR_ZONES if it
+ * never does. */
+static pfa_zone_id_t
+zone_peer(pfa_zone_id_t zone)
+{
+        if (zone == PFA_ZONE_LOW)
+                return PFA_ZONE_HIGH;
+        else if (zone == PFA_ZONE_HIGH)
+                return PFA_ZONE_LOW;
+        return PFA_NR_ZONES;
+}
+
+/* Low memory must be reachable through the kernel's linear mapping. */
+static bool
+block_fits_zone(page_t *pg, unsigned int order, pfa_zone_id_t zone)
 {
+        if (zone != PFA_ZONE_LOW)
+                return true;
+        return page_to_pfn(pg) + (1UL << order)
+               <= linear_pfn_end(pfa.limits);
+}
+
+/* Move a free max-order block from the zone's peer into the zone.
+ * Returns false if the peer cannot spare one. */
+static bool
+zone_borrow(pfa_zone_id_t zone)
+{
+        const unsigned int order = PFA_MAX_PAGE_ORDER - 1;
+        pfa_zone_id_t peer = zone_peer(zone);
+        pfa_zone_t *to = &pfa.zones[zone];
+        pfa_zone_t *from;
+        page_t *pg;
+
+        if (peer == PFA_NR_ZONES)
+                return false;
+        from = &pfa.zones[peer];
+        for (;;)
+        {
+                /* Never push the lender below its own high mark. */
+                if (from->nr_free_pages >= from->wmark[PFA_WMARK_HIGH] +
+                                           (1UL << order)) {
+                        /* Blocks are freed onto the head of the list at
+                         * boot, so the lowest frames are at the tail. */
+                        list_foreach_entry_prev(&from->blocks[order].list,
+                                                pg, list)
+                        {
+                                if (!block_fits_zone(pg, order, zone))
+                                        continue;
+                                zone_del_block(from, pg, order);
+                                block_set_zone(pg, order, zone);
+                                zone_add_block(to, pg, order);
+                                from->nr_lent++;
+                                to->nr_borrowed++;
+                                return true;
+                        }
+                }
+                if (!zone_grow(from))
+                        return false;
+        }
+}
+
+static page_t *
+buddy_alloc(pfa_zone_id_t zone, unsigned int order)
+{
+        unsigned long i, avail;
+        page_t *page;
+        pfa_zone_t *z = &pfa.zones[zone];
+
+        /* Orders at least as big as the request that have a free
+         * block. */
+        avail = z->order_map & ~((1UL << order) - 1);
+        while (!avail) {
+                /* Fall back to any section deferred at boot, then to
+                 * the zone's peer. */
+                if (!zone_grow(z) && !zone_borrow(zone))
+                        return NULL;
+                avail = z->order_map & ~((1UL << order) - 1);
+        }
+        i = _ffs(avail);
+
+        page = list_first_entry(&z->blocks[i].list, page_t, list);
+        zone_del_block(z, page, i);
+
+        /* Trim if needed. */
+        while (i > order)
+        {
+                i--;
+                zone_add_block(z, page + (1UL << i), i);
+        }
+        page->order = order;
+
+        /* Top the zone up before it runs dry, and failing that, have
+         * memory reclaimed in the background. */
+        if (z->nr_free_pages < z->wmark[PFA_WMARK_LOW] && !zone_grow(z) &&
+            !zone_borrow(zone))
+                pfa.reclaim_zones |= 1UL << zone;
+
+        return page;
+}
+
+static page_t *
+find_buddy(page_t *page, unsigned int order)
+{
+        unsigned long _buddy = page_to_pfn(page) ^ (1UL << order);
+
+        /* Blocks never span sections, so the buddy is in the same
+         * section, whose page structs are set up. */
+        if (_buddy >= pfa.limits->max_pfn)
+                return NULL;
+        return pfn_to_page(_buddy);
+}
+
+static void
+buddy_free(page_t *p, unsigned int order)
+{
+        pfa_zone_id_t zone = zone_of_page(p);
+        pfa_zone_t *z = &pfa.zones[zone];
+
+        /* Try to coalesce. */
+        while (order < PFA_MAX_PAGE_ORDER - 1)
+        {
+                page_t *buddy = find_buddy(p, order);
+
+                if (!buddy || !is_avail(buddy))
+                        break;
+                if (buddy->order != order)
+                        break;
+                if (zone_of_page(buddy) != zone)
+                        break;
+
+                zone_del_block(z, buddy, order);
+                if (buddy < p)
+                        p = buddy;
+                ++order;
+        }
+
+        zone_add_block(z, p, order);
+}
+
+/* Returns the current CPU's page cache for the given zone, or NULL if
+ * the per-CPU caches are not yet usable. */
+static pfa_pcp_t *
+pcp_get(pfa_zone_id_t zone)
+{
+        pfa_pcpu_t *pcpu;
         unsigned int i;
+
+        if (!pfa.pcp_ready)
+                return NULL;
+        pcpu = PERCPU_GET(pfa_pcpu);
+        if (!pcpu->ready) {
+                /* Secondary CPUs start off with a zeroed copy. */
+                for (i = 0; i < PFA_NR_ZONES; i++)
+                {
+                        list_head_init(&pcpu->zones[i].hot);
+                        list_head_init(&pcpu->zones[i].cold);
+                        pcpu->zones[i].count = 0;
+                }
+                pcpu->ready = true;
+        }
+        return &pcpu->zones[zone];
+}
+
+/* Move up to a batch of pages from the buddy lists to the cold end of
+ * the cache. Returns the number of pages added. */
+static unsigned int
+pcp_refill(pfa_pcp_t *pcp, pfa_zone_id_t zone)
+{
+        unsigned int n;
+        for (n = 0; n < PFA_PCP_BATCH; n++)
+        {
+                page_t *page = buddy_alloc(zone, 0);
+                if (!page)
+                        break;
+                list_add_tail(&pcp->cold, &page->list);
+        }
+        pcp->count += n;
+        return n;
+}
+
+/* Give up to 'num' pages back to the buddy lists, coldest first. */
+static void
+pcp_drain(pfa_pcp_t *pcp, unsigned int num)
+{
+        while (num-- > 0 && pcp->count > 0)
+        {
+                struct list_head *l = list_empty(&pcp->cold)
+                                      ? &pcp->hot : &pcp->cold;
+                page_t *page = list_last_entry(l, page_t, list);
+                list_del(&page->list);
+                pcp->count--;
+                buddy_free(page, 0);
+        }
+}
+
+static page_t *
+pcp_alloc(pfa_pcp_t *pcp, pfa_zone_id_t zone)
+{
+        struct list_head *l;
         page_t *page;
-        pfa_block_t *zone, *zones;
 
-        if (order >= PFA_MAX_PAGE_ORDER)
+        if (pcp->count == 0 && pcp_refill(pcp, zone) == 0)
                 return NULL;
+        l = list_empty(&pcp->hot) ? &pcp->cold : &pcp->hot;
+        page = list_first_entry(l, page_t, list);
+        list_del(&page->list);
+        pcp->count--;
+        page->order = 0;
+        return page;
+}
+
+static void
+pcp_free(pfa_pcp_t *pcp, page_t *page)
+{
+        list_add(&pcp->hot, &page->list);
+        if (++pcp->count > PFA_PCP_HIGH)
+                pcp_drain(pcp, PFA_PCP_BATCH);
+}
+
+void
+pfa_init_late(void)
+{
         bug_on(!pfa.ready, "PFA used before initialization.");
+        pfa.pcp_ready = true;
+        /* Set up the boot CPU's caches now. */
+        (void)pcp_get(PFA_ZONE_LOW);
+}
 
-        if (BAD_MFLAGS(flags))
+void
+pfa_drain_pcp(void)
+{
+        unsigned int i;
+        for (i = 0; i < PFA_NR_ZONES; i++)
+        {
+                pfa_pcp_t *pcp = pcp_get(i);
+                if (pcp)
+                        pcp_drain(pcp, pcp->count);
+        }
+}
+
+/* Take a page out of the zone's zero pool, or NULL if it is empty. A
+ * page of the given color is preferred if color is below PFA_NR_COLORS.
+ * The pool is filled in pfn order, so the first PFA_NR_COLORS pages in
+ * it usually cover every color, and no more are looked at. */
+static page_t *
+zero_pool_get(pfa_zone_t *z, unsigned long color)
+{
+        page_t *page, *pg;
+        unsigned long n = 0;
+
+        if (z->nr_zero == 0)
                 return NULL;
+        page = list_first_entry(&z->zero_pages, page_t, list);
+        if (color < PFA_NR_COLORS) {
+                list_foreach_entry(&z->zero_pages, pg, list)
+                {
+                        if (n++ == PFA_NR_COLORS)
+                                break;
+                        if ((page_to_pfn(pg) & (PFA_NR_COLORS - 1)) == color) {
+                                page = pg;
+                                break;
+                        }
+                }
+        }
+        list_del(&page->list);
+        z->nr_zero--;
+        return page;
+}
 
-        if (flags & M_DMA) {
-                zones = pfa.dma_zones;
-        } else if (flags & M_HIGH) {
-                zones = pfa.high_zones;
-        } else {
-                zones = pfa.low_zones;
+/* Give every page in the zone's zero pool back to the buddy lists. */
+static void
+zero_pool_drain(pfa_zone_t *z)
+{
+        page_t *page;
+        while ((page = zero_pool_get(z, PFA_NR_COLORS)) != NULL)
+        {
+                page->flags &= ~PG_ZERO;
+                buddy_free(page, 0);
         }
+}
 
-        for (i = order; i < PFA_MAX_PAGE_ORDER; i++)
+/* Give every page on the zone's color lists back to the buddy lists. */
+static void
+color_pool_drain(pfa_zone_t *z)
+{
+        unsigned long c;
+        for (c = 0; c < PFA_NR_COLORS && z->nr_colored; c++)
         {
-                zone = &zones[i];
-                if (list_empty(&zone->list))
-                        continue;
-                page = list_first_entry(&zone->list, page_t, list);
+                while (!list_empty(&z->color_pages[c]))
+                {
+                        page_t *page = list_first_entry(&z->color_pages[c],
+                                                        page_t, list);
+                        list_del(&page->list);
+                        z->nr_colored--;
+                        buddy_free(page, 0);
+                }
+        }
+}
+
+/* Take 2^order pages starting at the given color out of the zone.
+ * Single pages come off the color lists if they can. Otherwise a block
+ * holding every color is split up, and the pages of it that were not
+ * asked for are sorted onto the color lists. */
+static page_t *
+color_alloc(pfa_zone_id_t zone, unsigned int order, unsigned long color)
+{
+        pfa_zone_t *z = &pfa.zones[zone];
+        unsigned long pfn, c;
+        page_t *page;
+
+        color &= ~((1UL << order) - 1);
+        if (order == 0 && !list_empty(&z->color_pages[color])) {
+                page = list_first_entry(&z->color_pages[color], page_t, list);
                 list_del(&page->list);
-                mark_allocated(page);
+                z->nr_colored--;
+                pfa.nr_color_hits++;
+                return page;
+        }
 
-                /* Trim if needed. */
-                while (i > order)
+        page = buddy_alloc(zone, PFA_COLOR_ORDER);
+        if (!page)
+                return NULL;
+        pfa.nr_color_splits++;
+        pfn = page_to_pfn(page);
+        for (c = 0; c < PFA_NR_COLORS; c++)
+        {
+                page_t *pg = pfn_to_page(pfn + c);
+                if (c >= color && c < color + (1UL << order))
+                        continue;
+                if (z->nr_colored < PFA_COLOR_POOL_HIGH) {
+                        pg->order = 0;
+                        list_add_tail(&z->color_pages[c], &pg->list);
+                        z->nr_colored++;
+                } else {
+                        buddy_free(pg, 0);
+                }
+        }
+        page = pfn_to_page(pfn + color);
+        page->order = order;
+        return page;
+}
+
+unsigned long
+pfa_zero_refill(unsigned long max)
+{
+        pfa_zone_id_t zone;
+        unsigned long n = 0;
+
+        /* DMA memory is too scarce to set aside. */
+        for (zone = PFA_ZONE_LOW; zone <= PFA_ZONE_HIGH; zone++)
+        {
+                pfa_zone_t *z = &pfa.zones[zone];
+                while (n < max && z->nr_zero < PFA_ZERO_POOL_HIGH &&
+                       z->nr_free_pages > z->wmark[PFA_WMARK_HIGH])
                 {
-                        i--;
-                        page_t *buddy = (page_t *)(page + (1UL << i));
-                        buddy->order = i;
-                        mark_avail(buddy);
-                        list_add(&zones[i].list, &buddy->list);
+                        page_t *pg = buddy_alloc(zone, 0);
+                        if (!pg)
+                                break;
+                        /* Only the linear map is at hand to zero it, and
+                         * it covers every frame below linear_pfn_end. */
+                        if (page_to_pfn(pg) >= linear_pfn_end(pfa.limits)) {
+                                buddy_free(pg, 0);
+                                break;
+                        }
+                        bzero((void *)_va(page_to_phys(pg)), PAGE_SIZE);
+                        pg->flags |= PG_ZERO;
+                        list_add_tail(&z->zero_pages, &pg->list);
+                        z->nr_zero++;
+                        n++;
                 }
-                page->order = order;
+        }
+        return n;
+}
 
-                return page;
+void
+pfa_register_reclaim(pfa_reclaimer_t *r)
+{
+        bug_on(!r || !r->reclaim, "Bad reclaim callback");
+        list_add_tail(&reclaimers, &r->list);
+}
+
+void
+pfa_unregister_reclaim(pfa_reclaimer_t *r)
+{
+        list_del(&r->list);
+}
+
+unsigned long
+pfa_reclaim(unsigned long nr)
+{
+        static bool in_reclaim = false;
+        pfa_reclaimer_t *r;
+        unsigned long freed = 0;
+
+        /* Memory freed by a callback must not start another round. */
+        if (in_reclaim)
+                return 0;
+        in_reclaim = true;
+        list_foreach_entry(&reclaimers, r, list)
+        {
+                if (freed >= nr)
+                        break;
+                freed += r->reclaim(nr - freed);
+        }
+        in_reclaim = false;
+        /* Freed single pages end up in the per-CPU caches, where the
+         * watermarks cannot see them. */
+        pfa_drain_pcp();
+        pfa.nr_reclaimed += freed;
+        return freed;
+}
+
+/* Reclaim memory until every zone that dropped below its low mark is
+ * back above its high mark, or nothing more can be freed. */
+static void
+background_reclaim(void)
+{
+        pfa_zone_id_t zone;
+
+        for (zone = 0; zone < PFA_NR_ZONES; zone++)
+        {
+                pfa_zone_t *z = &pfa.zones[zone];
+                if (!(pfa.reclaim_zones & (1UL << zone)))
+                        continue;
+                while (z->nr_free_pages < z->wmark[PFA_WMARK_HIGH])
+                {
+                        if (!pfa_reclaim(z->wmark[PFA_WMARK_HIGH] -
+                                         z->nr_free_pages))
+                                break;
+                }
+                pfa.reclaim_zones &= ~(1UL << zone);
+                pfa.nr_bg_reclaim++;
+        }
+}
+
+/* Reclaim memory and top up the zero pools, but only when the timer
+ * interrupted user code, so that the kernel is never caught halfway
+ * through an allocation. */
+static unsigned long
+pfa_tick(void)
+{
+        proc_t *p = proc_current();
+        if (p && p->state.sched_context == PROC_CONTEXT_USER) {
+                if (pfa.reclaim_zones)
+                        background_reclaim();
+                (void)pfa_zero_refill(PFA_ZERO_POOL_BATCH);
         }
+        return PFA_ZERO_INTERVAL_US;
+}
 
-        return NULL;
+int
+pfa_init_background(void)
+{
+        unsigned long n = pfa_zero_refill(2 * PFA_ZERO_POOL_HIGH);
+        timer_init(&pfa_timer, pfa_tick);
+        timer_start(&pfa_timer, PFA_ZERO_INTERVAL_US);
+        kprintf(0, "pfa: %d pages pre-zeroed\n", n);
+        return 0;
+}
+SYSINIT_STEP("pfa_background", pfa_init_background, SYSINIT_LATE, 0);
+
+void
+pfa_clear_page(page_t *pg)
+{
+        /* Nothing may unmap a frame below linear_pfn_end from the
+         * linear map; those above it have no linear address at all. */
+        bug_on(page_to_pfn(pg) >= linear_pfn_end(pfa.limits),
+               "Clearing a page outside the linear map");
+        if (!(pg->flags & PG_ZERO))
+                bzero((void *)_va(page_to_phys(pg)), PAGE_SIZE);
+        pg->flags &= ~PG_ZERO;
 }
 
 static page_t *
-find_buddy(page_t *page, unsigned int order)
+zone_alloc(pfa_zone_id_t zone, unsigned int order)
 {
-        unsigned long _block, _buddy;
+        pfa_zone_t *z = &pfa.zones[zone];
+        pfa_pcp_t *pcp = pcp_get(zone);
+        page_t *page;
 
-        bug_on(page < pfa.pages, "Invalid page reference");
+        if (order == 0 && pcp) {
+                page = pcp_alloc(pcp, zone);
+                if (page)
+                        return page;
+        }
 
-        _block = (unsigned long)page - (unsigned long)pfa.pages;
-        _buddy = _block ^ (1UL << order);
+        page = buddy_alloc(zone, order);
+        if (!page && pcp) {
+                /* Pages parked in the cache may be the missing buddies
+                 * of a bigger block. */
+                pcp_drain(pcp, pcp->count);
+                page = buddy_alloc(zone, order);
+        }
+        if (!page && (z->nr_zero || z->nr_colored)) {
+                /* The zero and color pools are only worth keeping while
+                 * memory is plentiful. */
+                zero_pool_drain(z);
+                color_pool_drain(z);
+                page = buddy_alloc(zone, order);
+        }
+        if (!page && zone == PFA_ZONE_HIGH) {
+                /* User pages may come out of low memory, so long as
+                 * that leaves enough for the kernel. */
+                pfa_zone_t *low = &pfa.zones[PFA_ZONE_LOW];
+                if (low->nr_free_pages >= low->wmark[PFA_WMARK_HIGH] +
+                                          (1UL << order))
+                        page = buddy_alloc(PFA_ZONE_LOW, order);
+                if (page)
+                        pfa.zones[zone].nr_fallback++;
+        }
+        return page;
+}
+
+static bool
+zone_watermark_ok(pfa_zone_t *z, unsigned int order, pfa_wmark_t mark)
+{
+        return z->nr_free_pages >= z->wmark[mark] + (1UL << order);
+}
+
+/* Make sure that taking 2^order pages leaves the zone above its min
+ * mark. Memory not yet on the free lists is used first: deferred
+ * sections, blocks borrowed from the peer zone, and cached pages. Only
+ * then is memory reclaimed. */
+static bool
+zone_replenish(pfa_zone_id_t zone, unsigned int order)
+{
+        pfa_zone_t *z = &pfa.zones[zone];
+
+        while (!zone_watermark_ok(z, order, PFA_WMARK_MIN))
+        {
+                if (!zone_grow(z) && !zone_borrow(zone))
+                        break;
+        }
+        if (zone_watermark_ok(z, order, PFA_WMARK_MIN))
+                return true;
 
-        return (page_t *)((unsigned long)pfa.pages + _buddy);
+        pfa_drain_pcp();
+        zero_pool_drain(z);
+        color_pool_drain(z);
+        if (!zone_watermark_ok(z, order, PFA_WMARK_MIN)) {
+                pfa.nr_direct_reclaim++;
+                (void)pfa_reclaim(z->wmark[PFA_WMARK_HIGH] + (1UL << order)
+                                  - z->nr_free_pages);
+        }
+        return zone_watermark_ok(z, order, PFA_WMARK_MIN);
+}
+
+/* Allocate a block, of the given color if it is below PFA_NR_COLORS. */
+static page_t *
+alloc_pages(mflags_t flags, unsigned int order, unsigned long color)
+{
+        pfa_zone_id_t zone;
+        page_t *page;
+
+        if (order >= PFA_MAX_PAGE_ORDER)
+                return NULL;
+        bug_on(!pfa.ready, "PFA used before initialization.");
+
+        if (BAD_MFLAGS(flags))
+                return NULL;
+
+        zone = zone_of_flags(flags);
+        if ((flags & M_WAIT) && !zone_replenish(zone, order)) {
+                /* Leave the reserve to allocations that cannot wait. */
+                pfa.zones[zone].nr_throttled++;
+                return NULL;
+        }
+
+        page = NULL;
+        /* A pre-zeroed page saves more than a page of the right color
+         * gains, though the pool is searched for that color too. */
+        if (order == 0 && (flags & M_ZERO)) {
+                page = zero_pool_get(&pfa.zones[zone], color);
+                if (page)
+                        pfa.nr_zero_hits++;
+                else
+                        pfa.nr_zero_misses++;
+        }
+        if (!page && color < PFA_NR_COLORS)
+                page = color_alloc(zone, order, color);
+        if (!page)
+                page = zone_alloc(zone, order);
+        if (!page && order > 0 && (flags & M_WAIT) &&
+            pfa_compact(flags, order))
+                page = zone_alloc(zone, order);
+        if (!page)
+                return NULL;
+        clear_owner(page_to_pfn(page), 1UL << order);
+        if (flags & M_MOVABLE)
+                page->flags |= PG_MOVABLE;
+        return page;
+}
+
+page_t *
+pfa_alloc_pages(mflags_t flags, unsigned int order)
+{
+        return alloc_pages(flags, order, PFA_NR_COLORS);
+}
+
+page_t *
+pfa_alloc_colored(mflags_t flags, unsigned int order, vaddr_t va)
+{
+        if (order >= PFA_COLOR_ORDER)
+                return alloc_pages(flags, order, PFA_NR_COLORS);
+        return alloc_pages(flags, order, pfa_color_of(va));
 }
 
 void
 pfa_free_pages(page_t *p, unsigned int order)
 {
+        pfa_pcp_t *pcp;
+
         bug_on(!pfa.ready, "PFA used before initialization.");
         bug_on(order >= PFA_MAX_PAGE_ORDER, "Page zone too big");
-        bug_on(is_avail(p), "Page not allocated before freeing");
 
         if (!p) return;
+        bug_on(is_avail(p), "Page not allocated before freeing");
+        p->flags &= ~(PG_MOVABLE | PG_ZERO);
+        clear_owner(page_to_pfn(p), 1UL << order);
 
-        /* Try to coalesce. */
-        while (order < PFA_MAX_PAGE_ORDER)
+        pcp = order == 0 ? pcp_get(zone_of_page(p)) : NULL;
+        if (pcp)
+                pcp_free(pcp, p);
+        else
+                buddy_free(p, order);
+}
+
+void
+pfa_set_migrate(pfa_migrate_t fn)
+{
+        pfa_migrate = fn;
+}
+
+/* Returns true if the page struct of the frame can be looked at. */
+static bool
+pfn_valid(unsigned long pfn)
+{
+        unsigned long sec = pfn >> PFA_SECTION_ORDER;
+        return pfn < pfa.limits->max_pfn && sec < pfa.nr_sections &&
+               pfa.sections[sec].ready;
+}
+
+/* Try to make the naturally aligned block of 2^order pages at 'pfn'
+ * free, by moving every movable block in it somewhere else. The block
+ * must not contain anything but free and movable blocks of the zone.
+ * Returns true if the whole block ended up on the free lists. */
+static bool
+compact_block(pfa_zone_id_t zone, unsigned long pfn, unsigned int order)
+{
+        const unsigned long end = pfn + (1UL << order);
+        pfa_zone_t *z = &pfa.zones[zone];
+        unsigned long q, nr_movable = 0;
+        unsigned int ord;
+        page_t *pg;
+
+        /* First make sure that the block can be emptied at all. */
+        for (q = pfn; q < end; q += 1UL << ord)
         {
-                page_t *buddy = find_buddy(p, order);
+                if (!pfn_valid(q))
+                        return false;
+                pg = pfn_to_page(q);
+                ord = pg->order;
+                if (zone_of_page(pg) != zone || ord >= order)
+                        return false;
+                if (pg->flags & PG_MOVABLE)
+                        nr_movable++;
+                else if (!is_avail(pg))
+                        return false;
+        }
+        if (nr_movable == 0 || !pfa_migrate)
+                return false;
+
+        /* Take the free parts off the free lists, so that nothing we
+         * move out is moved straight back in. */
+        for (q = pfn; q < end; q += 1UL << ord)
+        {
+                pg = pfn_to_page(q);
+                ord = pg->order;
+                if (is_avail(pg))
+                        zone_del_block(z, pg, ord);
+        }
+
+        for (q = pfn; q < end; q += 1UL << ord)
+        {
+                page_t *to;
 
-                if (!is_avail(buddy))
+                pg = pfn_to_page(q);
+                ord = pg->order;
+                if (!(pg->flags & PG_MOVABLE))
+                        continue;
+                to = buddy_alloc(zone, ord);
+                if (!to)
                         break;
-                if (buddy->order != order)
+                if (!pfa_migrate(pg, to, ord)) {
+                        buddy_free(to, ord);
                         break;
+                }
+                to->flags |= PG_MOVABLE;
+                pg->flags &= ~PG_MOVABLE;
+                pfa.nr_migrated++;
+        }
 
-                list_del(&buddy->list);
-                if (buddy < p)
-                        p = buddy;
-                ++order;
-                p->order = order;
+        if (q >= end) {
+                pfa.nr_compacted++;
+                buddy_free(pfn_to_page(pfn), order);
+                return true;
         }
 
-        p->order = order;
-        mark_avail(p);
-        if (is_dma(pfa.limits, page_to_phys(p)))
-                list_add(&pfa.dma_zones[order].list, &p->list);
-        else if (is_lowmem(pfa.limits, page_to_phys(p)))
-                list_add(&pfa.low_zones[order].list, &p->list);
-        else
-                list_add(&pfa.high_zones[order].list, &p->list);
+        /* Give back whatever we have taken so far. Freeing may merge
+         * a block into its buddy, so note its order beforehand. */
+        pfa.nr_compact_fail++;
+        for (q = pfn; q < end; q += 1UL << ord)
+        {
+                pg = pfn_to_page(q);
+                ord = pg->order;
+                if (!(pg->flags & PG_MOVABLE))
+                        buddy_free(pg, ord);
+        }
+        return false;
+}
+
+bool
+pfa_compact(mflags_t flags, unsigned int order)
+{
+        pfa_zone_id_t zone = zone_of_flags(flags);
+        unsigned long pfn;
+
+        if (order >= PFA_MAX_PAGE_ORDER || !pfa_migrate)
+                return false;
+        /* Cached pages are neither free nor movable. */
+        pfa_drain_pcp();
+        color_pool_drain(&pfa.zones[zone]);
+        for (pfn = 0; pfn < pfa.limits->max_pfn; pfn += 1UL << order)
+        {
+                if (compact_block(zone, pfn, order))
+                        return true;
+        }
+        return false;
+}
+
+/* Give the pages in [pfn, end) back to the buddy lists, as the largest
+ * aligned blocks that fit. */
+static void
+release_range(unsigned long pfn, unsigned long end)
+{
+        while (pfn < end)
+        {
+                unsigned int ord = PFA_MAX_PAGE_ORDER - 1;
+                while (ord > 0 &&
+                       ((pfn & ((1UL << ord) - 1)) || pfn + (1UL << ord) > end))
+                        ord--;
+                buddy_free(pfn_to_page(pfn), ord);
+                pfn += 1UL << ord;
+        }
+}
+
+/* Whether the max-order block at 'pfn' is free and in the zone. */
+static bool
+max_block_free(pfa_zone_id_t zone, unsigned long pfn)
+{
+        page_t *pg;
+
+        if (!pfn_valid(pfn))
+                return false;
+        pg = pfn_to_page(pfn);
+        return is_avail(pg) && pg->order == PFA_MAX_PAGE_ORDER - 1 &&
+               zone_of_page(pg) == zone;
+}
+
+/* Find 'nr' free max-order blocks in a row in the zone. When 'compact'
+ * is set, blocks in the way are compacted. Returns the first frame of
+ * the run, or 0 if there is none. */
+static unsigned long
+find_max_run(pfa_zone_id_t zone, unsigned long nr, bool compact)
+{
+        const unsigned int order = PFA_MAX_PAGE_ORDER - 1;
+        const unsigned long max_pfn = pfa.limits->max_pfn;
+        unsigned long pfn, i;
+
+        /* Frame 0 is never RAM, so it cannot start a run. */
+        for (pfn = 1UL << order; pfn + (nr << order) <= max_pfn;
+             pfn += 1UL << order)
+        {
+                for (i = 0; i < nr; i++)
+                {
+                        unsigned long b = pfn + (i << order);
+                        if (!max_block_free(zone, b) &&
+                            !(compact && compact_block(zone, b, order)))
+                                break;
+                }
+                /* Compaction may have split blocks that were already
+                 * counted, so check the run again. */
+                for (i = 0; i < nr; i++)
+                {
+                        if (!max_block_free(zone, pfn + (i << order)))
+                                break;
+                }
+                if (i == nr)
+                        return pfn;
+                pfn += i << order;
+        }
+        return 0;
+}
+
+page_t *
+pfa_alloc_contig(mflags_t flags, unsigned long npages)
+{
+        const unsigned int order = PFA_MAX_PAGE_ORDER - 1;
+        pfa_zone_id_t zone;
+        pfa_zone_t *z;
+        unsigned long pfn, nr, i;
+
+        bug_on(!pfa.ready, "PFA used before initialization.");
+        if (npages == 0 || BAD_MFLAGS(flags))
+                return NULL;
+        /* A contiguous range is never moved. */
+        flags &= ~M_MOVABLE;
+
+        if (npages <= (1UL << order)) {
+                unsigned int ord = next_pow2(npages);
+                page_t *page = pfa_alloc_pages(flags, ord);
+                if (page)
+                        release_range(page_to_pfn(page) + npages,
+                                      page_to_pfn(page) + (1UL << ord));
+                return page;
+        }
+
+        zone = zone_of_flags(flags);
+        z = &pfa.zones[zone];
+        /* The run is looked for frame by frame, so every page struct
+         * of the zone must be set up. */
+        while (zone_grow(z))
+                ;
+        nr = (npages + (1UL << order) - 1) >> order;
+        pfn = find_max_run(zone, nr, false);
+        if (!pfn && (flags & M_WAIT) && pfa_migrate) {
+                pfa_drain_pcp();
+                color_pool_drain(z);
+                pfn = find_max_run(zone, nr, true);
+        }
+        if (!pfn)
+                return NULL;
+
+        for (i = 0; i < nr; i++)
+                zone_del_block(z, pfn_to_page(pfn + (i << order)), order);
+        release_range(pfn + npages, pfn + (nr << order));
+        clear_owner(pfn, npages);
+        return pfn_to_page(pfn);
+}
+
+void
+pfa_free_contig(page_t *page, unsigned long npages)
+{
+        unsigned long pfn;
+
+        bug_on(!pfa.ready, "PFA used before initialization.");
+        if (!page)
+                return;
+        pfn = page_to_pfn(page);
+        clear_owner(pfn, npages);
+        release_range(pfn, pfn + npages);
 }
 
 void
@@ -330,17 +1245,52 @@ pfa_report(bool full)
 {
         int i = 0;
         if (full) {
-                kprintf(0, "=== Low Zones ===\n");
-                for (i = 0; i < PFA_MAX_PAGE_ORDER; i++)
+                static const char *zone_names[PFA_NR_ZONES] = {
+                        "DMA", "Low", "High"
+                };
+                for (i = 0; i < PFA_NR_ZONES; i++)
                 {
-                        kprintf(0, "%3d: %d\n",
-                                (1 << i), list_size(&pfa.low_zones[i].list));
+                        pfa_zone_t *z = &pfa.zones[i];
+                        unsigned int j;
+                        kprintf(0, "=== %s Zones (%d free, %d deferred) ===\n",
+                                zone_names[i], z->nr_free_pages,
+                                range_pages_avail(pfa.limits, z->init_pfn,
+                                                  z->end_pfn));
+                        kprintf(0, "watermarks %d/%d/%d, throttled %d\n",
+                                z->wmark[PFA_WMARK_MIN],
+                                z->wmark[PFA_WMARK_LOW],
+                                z->wmark[PFA_WMARK_HIGH], z->nr_throttled);
+                        kprintf(0, "borrowed %d, lent %d, fallback %d\n",
+                                z->nr_borrowed, z->nr_lent,
+                                z->nr_fallback);
+                        for (j = 0; j < PFA_MAX_PAGE_ORDER; j++)
+                        {
+                                kprintf(0, "%4d: %d\n",
+                                        (1 << j), z->blocks[j].nr_free);
+                        }
                 }
-                kprintf(0, "=== High Zones ===\n");
-                for (i = 0; i < PFA_MAX_PAGE_ORDER; i++)
-                {
-                        kprintf(0, "%3d: %d\n",
-                                (1 << i), list_size(&pfa.high_zones[i].list));
+                kprintf(0, "compaction: %d blocks freed, %d failed, "
+                           "%d blocks migrated\n", pfa.nr_compacted,
+                        pfa.nr_compact_fail, pfa.nr_migrated);
+                kprintf(0, "reclaim: %d pages, %d direct, %d background\n",
+                        pfa.nr_reclaimed, pfa.nr_direct_reclaim,
+                        pfa.nr_bg_reclaim);
+                kprintf(0, "zero pool: %d low, %d high, %d hits, "
+                           "%d misses\n", pfa.zones[PFA_ZONE_LOW].nr_zero,
+                        pfa.zones[PFA_ZONE_HIGH].nr_zero,
+                        pfa.nr_zero_hits, pfa.nr_zero_misses);
+                kprintf(0, "colors: %d low, %d high, %d hits, "
+                           "%d splits\n", pfa.zones[PFA_ZONE_LOW].nr_colored,
+                        pfa.zones[PFA_ZONE_HIGH].nr_colored,
+                        pfa.nr_color_hits, pfa.nr_color_splits);
+                if (pfa.pcp_ready) {
+                        kprintf(0, "=== Per-CPU Caches ===\n");
+                        for (i = 0; i < PFA_NR_ZONES; i++)
+                        {
+                                pfa_pcp_t *pcp = pcp_get(i);
+                                kprintf(0, "%4s: %d\n", zone_names[i],
+                                        pcp->count);
+                        }
                 }
         }
 
@@ -371,29 +1321,153 @@ pfa_report(bool full)
                         highmem_top(pfa.limits));
 }
 
-page_t *
-pfa_base(void)
-{
-        return pfa.pages;
-}
-
 __test void
 pfa_test(void)
 {
+        unsigned int i;
         /* First, ensure that each type of alloc stays in its region. */
         page_t *p;
         p = pfa_alloc(M_DMA);
         bug_on(!is_dma(pfa.limits, page_to_phys(p)),
                         "DMA alloc out of range");
         pfa_free(p);
+        /* The low and high zones move around, but low memory is
+         * always linearly mapped, and neither ever includes DMA. */
         p = pfa_alloc(M_KERNEL);
-        bug_on(!is_lowmem(pfa.limits, page_to_phys(p)),
+        bug_on(zone_of_page(p) != PFA_ZONE_LOW ||
+               page_to_pfn(p) >= linear_pfn_end(pfa.limits),
                         "Low alloc out of range");
         pfa_free(p);
         p = pfa_alloc(M_HIGH);
-        bug_on(!is_highmem(pfa.limits, page_to_phys(p)),
+        bug_on(zone_of_page(p) == PFA_ZONE_DMA ||
+               is_dma(pfa.limits, page_to_phys(p)),
                         "High alloc out of range");
         pfa_free(p);
 
+        /* Whatever a frame was last used for is forgotten when it is
+         * freed, so it cannot be mistaken for its next owner's. */
+        p = pfa_alloc_pages(M_KERNEL, 1);
+        bug_on(!p, "Alloc failed");
+        p[0].shared = p[1].shared = 1;
+        pfa_free_pages(p, 1);
+        bug_on(p[0].shared || p[1].shared, "Freed pages kept their owner");
+
+        /* A borrowed block, and every page in it, changes zones. */
+        if (zone_borrow(PFA_ZONE_LOW)) {
+                pfa_zone_t *lo = &pfa.zones[PFA_ZONE_LOW];
+                unsigned int ord = PFA_MAX_PAGE_ORDER - 1;
+                p = list_first_entry(&lo->blocks[ord].list, page_t, list);
+                bug_on(zone_of_page(p) != PFA_ZONE_LOW ||
+                       zone_of_page(p + (1UL << ord) - 1) != PFA_ZONE_LOW,
+                       "Borrowed block not moved to the low zone");
+                bug_on(!block_fits_zone(p, ord, PFA_ZONE_LOW),
+                       "Borrowed block outside the linear map");
+                /* Give it back if low memory can spare it. */
+                (void)zone_borrow(PFA_ZONE_HIGH);
+        }
+
+        /* Pages in the zero pools must really be zero. */
+        for (i = PFA_ZONE_LOW; i <= PFA_ZONE_HIGH; i++)
+        {
+                unsigned long *w, nr;
+                unsigned int k;
+                if (pfa.zones[i].nr_zero == 0)
+                        continue;
+                p = list_first_entry(&pfa.zones[i].zero_pages, page_t, list);
+                bug_on(!(p->flags & PG_ZERO) || is_avail(p),
+                       "Bad page in zero pool");
+                w = (unsigned long *)_va(page_to_phys(p));
+                for (k = 0; k < PAGE_SIZE / sizeof(*w); k++)
+                        bug_on(w[k], "Zero pool page is dirty");
+                /* Colored M_ZERO pages come out of the pool as well. */
+                nr = pfa.zones[i].nr_zero;
+                p = pfa_alloc_colored((i == PFA_ZONE_HIGH ? M_HIGH : 0)
+                                      | M_ZERO, 0, page_to_phys(p));
+                bug_on(!p || !(p->flags & PG_ZERO) ||
+                       pfa.zones[i].nr_zero != nr - 1,
+                       "Colored M_ZERO alloc missed the zero pool");
+                pfa_free(p);
+        }
+
+        /* Colored blocks start at the color of their address, and are
+         * taken from the color lists once those are filled. */
+        {
+                page_t *colored[PFA_NR_COLORS];
+                for (i = 0; i < PFA_NR_COLORS; i++)
+                {
+                        vaddr_t va = (vaddr_t)(PFA_NR_COLORS + i) << PAGE_SHIFT;
+                        colored[i] = pfa_alloc_colored(M_HIGH, 0, va);
+                        bug_on(!colored[i], "Colored alloc failed");
+                        bug_on((page_to_pfn(colored[i]) & (PFA_NR_COLORS - 1))
+                               != pfa_color_of(va), "Page has the wrong color");
+                }
+                for (i = 0; i < PFA_NR_COLORS; i++)
+                        pfa_free(colored[i]);
+                p = pfa_alloc_colored(M_HIGH, 1, 3UL << PAGE_SHIFT);
+                bug_on(!p || (page_to_pfn(p) & (PFA_NR_COLORS - 1)) != 2,
+                       "Colored block is misaligned");
+                pfa_free_pages(p, 1);
+        }
+
+        /* Contiguous ranges, both within a block and across blocks. */
+        p = pfa_alloc_contig(M_HIGH, 3);
+        bug_on(!p, "Small contiguous alloc failed");
+        bug_on(is_avail(pfn_to_page(page_to_pfn(p) + 2)),
+               "Contiguous range is still free");
+        pfa_free_contig(p, 3);
+        p = pfa_alloc_contig(M_HIGH, (1UL << (PFA_MAX_PAGE_ORDER - 1)) + 1);
+        if (p) {
+                unsigned long pfn = page_to_pfn(p);
+                unsigned long n = (1UL << (PFA_MAX_PAGE_ORDER - 1)) + 1;
+                for (i = 0; i < n; i++)
+                {
+                        page_t *q = pfn_to_page(pfn + i);
+                        bug_on(!q || is_avail(q) ||
+                               zone_of_page(q) == PFA_ZONE_DMA,
+                               "Bad page in contiguous range");
+                }
+                pfa_free_contig(p, n);
+        }
+
+        /* The cached counts and order map must agree with the free
+         * lists. */
+        for (i = 0; i < PFA_NR_ZONES; i++)
+        {
+                pfa_zone_t *z = &pfa.zones[i];
+                unsigned long pages = 0;
+                unsigned int j;
+                for (j = 0; j < PFA_MAX_PAGE_ORDER; j++)
+                {
+                        unsigned long n = list_size(&z->blocks[j].list);
+                        page_t *pg;
+                        list_foreach_entry(&z->blocks[j].list, pg, list)
+                        {
+                                unsigned long pfn = page_to_pfn(pg);
+                                bug_on(zone_of_page(pg) != i,
+                                       "Free block on the wrong zone");
+                                bug_on(range_pages_avail(pfa.limits, pfn,
+                                        pfn + (1UL << j)) != (1UL << j),
+                                       "Free block covers a memory hole");
+                        }
+                        bug_on(n != z->blocks[j].nr_free,
+                               "Free block count out of sync");
+                        bug_on(!n != !_tst_bit(&z->order_map, j),
+                               "Order map out of sync");
+                        pages += n << j;
+                }
+                bug_on(pages != z->nr_free_pages,
+                       "Free page count out of sync");
+        }
+
+        /* A freed page should be the next one handed out. */
+        if (pfa.pcp_ready) {
+                page_t *q;
+                p = pfa_alloc(M_KERNEL);
+                pfa_free(p);
+                q = pfa_alloc(M_KERNEL);
+                bug_on(p != q, "Per-CPU cache is not LIFO");
+                pfa_free(q);
+        }
+
         kprintf(0, "pfa_test passed\n");
 }
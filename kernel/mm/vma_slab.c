@@ -36,6 +36,7 @@ THE POSSIBILITY OF SUCH DAMAGE.
  * 05/16
  */
 
+#include <machine/cpu.h>
 #include <mm/paging.h>
 #include <mm/pfa.h>
 #include <mm/pmm.h>
@@ -51,26 +52,35 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #include <sys/proc.h>
 #include <util/cmp.h>
 #include <util/math.h>
-#include <util/hash.h>
 
 typedef struct {
         size_t num_caches;
         struct list_head cache_list;
-        /* These contain slab and slab_buf objects for out-of-band
-         * slab tracking. */
+        /* This contains slab objects for out-of-band slab tracking. */
         mem_cache_t mem_cache;
-        mem_cache_t slab_buf_cache;
+        /* Magazines for the per-CPU object caches. */
+        mem_cache_t mag_cache;
         /* Caches of caches! */
         mem_cache_t cache_cache;
-        /* A fixed list of caches for generic allocations. */
+        /* A fixed list of caches for generic allocations, and the same
+         * again for M_DMA allocations. */
         mem_cache_t *kmalloc_caches;
+        mem_cache_t *kmalloc_dma_caches;
         size_t num_kmalloc_caches;
-        /* A cache for retaining our kmalloc_record records. */
-        mem_cache_t kmalloc_record_cache;
+        /* The kmalloc cache for each size class (see kmalloc_class). */
+        unsigned char kmalloc_index[2 * (SLAB_KMALLOC_MAX_ORD + 1)];
+        /* Bytes asked of kmalloc, bytes handed out, and what would have
+         * been handed out with power-of-two classes alone. */
+        unsigned long kmalloc_req_bytes;
+        unsigned long kmalloc_alloc_bytes;
+        unsigned long kmalloc_pow2_bytes;
         /* We only use this to attach a number to big kmalloc usage. */
         mem_cache_t kmalloc_big_cache;
 
-        struct list_head *reap_scanh; /* Where to start reaping from */
+        /* Caches that have empty slabs and may be shrunk, and the pages
+         * that those slabs hold. */
+        struct list_head shrink_caches;
+        unsigned long nr_shrinkable;
 } vma_t;
 
 typedef enum {
@@ -80,58 +90,66 @@ typedef enum {
         SLAB_STATE_INVAL = -1,
 } slab_state_t;
 
-typedef struct slab_buf slab_buf_t;
+/* Each free object holds the index of the next free object in its
+ * slab, so the freelist costs no memory of its own. It is a stack: the
+ * object freed last, which is likely still in the cache, is the next
+ * one handed out. */
+typedef uint16_t slab_free_t;
+
+#define SLAB_FREE_END ((slab_free_t)~0)
 
 typedef struct slab {
+        mem_cache_t     *cp;
         unsigned long    refct;
         unsigned long    num;
         slab_state_t     state;
         struct list_head slab_list;
-        struct list_head slab_map_list;
-        slab_buf_t      *freep;
-        slab_buf_t      *lastp;
-        slab_buf_t      *slab_bufs;
-        void            *buf;
+        slab_free_t      free;          /* First free object */
+        unsigned long    color;         /* Offset of buf in the slab */
+        void            *buf;           /* The first object */
 } slab_t;
 
 #define SLAB_INIT(slab) {                               \
+        .cp    = NULL,                                  \
         .refct = 0,                                     \
         .state = SLAB_STATE_EMPTY,                      \
         .slab_list = LIST_HEAD_INIT((slab).slab_list),  \
-        .slab_map_list = LIST_HEAD_INIT((slab).slab_map_list),  \
-        .freep = NULL,                                  \
-        .lastp = NULL,                                  \
-        .slab_bufs = NULL,                              \
+        .free  = SLAB_FREE_END,                         \
+        .color = 0,                                     \
         .buf = NULL,                                    \
 }
 
-/* For small objects, we keep these at the start of the memory buffer.
- * For big objects, this is kept as a dynamically allocated external
- * object, at sp->slab_bufs[slab_buf_index(sp, vaddr)]. */
-struct slab_buf {
-        void         *buf;
-        slab_t       *sp;
-        slab_buf_t   *next;
-        struct list_head slab_map_list;
-};
+typedef struct slab_mag {
+        struct list_head list;          /* In the depot */
+        unsigned int     rounds;        /* Objects in objs[] */
+        void            *objs[SLAB_MAG_ROUNDS];
+} slab_mag_t;
+
+static void cache_flush_mags(mem_cache_t *cp);
 
 static void
 mem_cache_ctor(void *p, __attribute__((unused)) size_t sz)
 {
         mem_cache_t *cp = (mem_cache_t *)p;
         cp->refct = 0;
+        cp->merged = NULL;
         cp->grown = 0;
         cp->wastage = 0;
+        cp->color_next = 0;
         cp->big_bused = 0;
+        cp->nr_empty = 0;
+        cp->nr_allocs = cp->nr_frees = 0;
+        cp->nr_grows = cp->nr_reaps = 0;
         list_head_init(&cp->cache_list);
         list_head_init(&cp->slabs_full);
         list_head_init(&cp->slabs_partial);
         list_head_init(&cp->slabs_empty);
-        int i = 0;
-        for (i = 0; i < SLAB_NUM_BUCKETS; i++)
-                list_head_init(&cp->slab_map[i]);
-
+        list_head_init(&cp->shrink_list);
         cp->obj_ctor = cp->obj_dtor = NULL;
+        bzero(cp->cpus, sizeof(cp->cpus));
+        list_head_init(&cp->mags_full);
+        list_head_init(&cp->mags_empty);
+        cp->nr_mags_full = 0;
 }
 
 static void
@@ -140,76 +158,53 @@ mem_cache_dtor(void *p, __attribute__((unused)) size_t sz)
         mem_cache_t *cp = (mem_cache_t *)p;
         bug_on(!list_empty(&cp->slabs_full), "Cache freed in use");
         bug_on(!list_empty(&cp->slabs_partial), "Cache freed in use");
+        bug_on(!list_empty(&cp->mags_full), "Cache freed in use");
         bzero(cp->name, CACHE_NAMELEN+1);
         list_del(&cp->cache_list);
 }
 
-static struct list_head *
-slab_bucket(mem_cache_t *cp, void *vaddr)
-{
-        uint32_t h = jenkins_hash32(&vaddr, sizeof(void *), 0xfeedbad);
-        return &cp->slab_map[h % SLAB_NUM_BUCKETS];
-}
-
-static void
-add_to_slab_map(mem_cache_t *cp, slab_buf_t *bp)
+/* The slab that the object at vaddr belongs to, as recorded in the
+ * page struct of its frame. */
+static slab_t *
+slab_of(void *vaddr)
 {
-        struct list_head *m = slab_bucket(cp, bp->buf);
-        list_add(m, &bp->slab_map_list);
+        page_t *page = phys_to_page(_pa(vaddr));
+        return page ? page->slab : NULL;
 }
 
-/* Assumes that the cache stores slab data out-of-band (SLABOFF) */
-static slab_buf_t *
-find_slab_buf_off(mem_cache_t *cp, void *vaddr)
-{
-        slab_buf_t *bp, *n;
-        struct list_head *m = slab_bucket(cp, vaddr);
-        list_foreach_entry_safe(m, bp, n, slab_map_list)
-        {
-                if (bp->buf == vaddr) {
-                        list_del(&bp->slab_map_list);
-                        return bp;
-                }
-        }
-        return NULL;
-}
+/* The start of the slab's pages. */
+#define slab_base(sp) ((void *)((char *)(sp)->buf - (sp)->color))
+/* The object at index i of the slab. */
+#define slab_obj(cp, sp, i) ((void *)((char *)(sp)->buf + (i) * (cp)->align))
+/* The freelist link kept in a free object. */
+#define slab_obj_next(obj) (*(slab_free_t *)(obj))
 
-/* Try to find the buffer control object for the given vaddr. */
-static slab_buf_t *
-find_slab_buf(mem_cache_t *cp, void *vaddr)
+/* The index of the object at vaddr in sp, or cp->num if there is no
+ * object there. */
+static unsigned long
+slab_obj_index(mem_cache_t *cp, slab_t *sp, void *vaddr)
 {
-        if (cp->flags & SLAB_CACHE_SLABOFF) {
-                /* Here we need to look up in the cache's hashtable. */
-                return find_slab_buf_off(cp, vaddr);
-        } else {
-                /* This is the easier case, since the buffer control
-                 * object is just below the vaddr. */
-                return (slab_buf_t *)vaddr - 1;
-        }
+        unsigned long off;
+
+        if ((char *)vaddr < (char *)sp->buf)
+                return cp->num;
+        off = (unsigned long)((char *)vaddr - (char *)sp->buf);
+        if (off % cp->align || off / cp->align >= cp->num)
+                return cp->num;
+        return off / cp->align;
 }
 
-#define SLAB_BUF_INIT(slab_buf) {                               \
-        .buf = NULL,                                            \
-        .cp  = NULL,                                            \
-        .next = NULL,                                           \
-}
-
-/* Use ONLY when the slab_buf is in-band (i.e. ~SLAB_CACHE_OFFSLAB) */
-#define slab_buf_hdr(buf)  (slab_buf_t *)(buf)
-#define slab_buf_data(buf) (void *)((slab_buf_t *)buf + 1)
-
 static void
 slab_ctor(void *p, __attribute__((unused)) size_t sz)
 {
         slab_t *sp = (slab_t *)p;
+        sp->cp     = NULL;
         sp->num    = 0;
         sp->refct  = 0;
         sp->state  = SLAB_STATE_EMPTY;
         list_head_init(&sp->slab_list);
-        list_head_init(&sp->slab_map_list);
-        sp->freep  = NULL;
-        sp->lastp  = NULL;
-        sp->slab_bufs = NULL;
+        sp->free   = SLAB_FREE_END;
+        sp->color  = 0;
         sp->buf    = NULL;
 }
 
@@ -221,156 +216,125 @@ slab_dtor(void *p, __attribute__((unused)) size_t sz)
         bug_on(sp->num > 0, "Slab freed in use");
 }
 
-static void
-slab_buf_ctor(void *p, __attribute__((unused)) size_t sz)
-{
-        slab_buf_t *sp = (slab_buf_t *)p;
-        sp->buf = NULL;
-        sp->sp = NULL;
-        sp->next = NULL;
-        list_head_init(&sp->slab_map_list);
-}
-
-static void *
-slab_data(mem_cache_t *cp, slab_t *sp)
-{
-        if (cp->flags & SLAB_CACHE_SLABOFF) {
-                return sp->buf;
-        } else {
-                return slab_buf_data(sp->buf);
-        }
-}
-
 /* This sets up everything except the linked lists and num, which are
  * set up in vma_init_kmalloc_caches(). */
-#define KMALLOC_CACHE(sz)                                       \
-        {.name ="kmalloc_"#sz,                                  \
+#define KMALLOC_CACHE_FLAGS(nm, sz, fl)                         \
+        {.name = nm,                                            \
          .obj_size = (sz),                                      \
          .pf_order = (sz < PAGE_SIZE ? 2 : 3),                  \
          .align    = (sz),                                      \
          .num      = 0,                                         \
          .refct    = 0,                                         \
+         .merged   = NULL,                                      \
          .grown    = 0,                                         \
          .wastage  = 0,                                         \
+         .colors   = 0,                                         \
+         .color_next = 0,                                       \
          .big_bused= 0,                                         \
-         .flags    = (sz < (PAGE_SIZE/8) ? 0 : SLAB_CACHE_SLABOFF),\
+         .nr_empty = 0,                                         \
+         .nr_allocs= 0,                                         \
+         .nr_frees = 0,                                         \
+         .nr_grows = 0,                                         \
+         .nr_reaps = 0,                                         \
+         .flags    = (fl) |                                     \
+                     (sz < (PAGE_SIZE/8) ? 0 : SLAB_CACHE_SLABOFF),\
+         {NULL, NULL},                                          \
          {NULL, NULL},                                          \
          {NULL, NULL},                                          \
          {NULL, NULL},                                          \
          {NULL, NULL},                                          \
-         { { NULL, NULL } },                                    \
          NULL, NULL                                             \
 }
 
-static mem_cache_t malloc_caches[] = {
-        KMALLOC_CACHE(4),
-        KMALLOC_CACHE(8),
-        KMALLOC_CACHE(16),
-        KMALLOC_CACHE(32),
-        KMALLOC_CACHE(64),
-        KMALLOC_CACHE(128),
-        KMALLOC_CACHE(256),
-        KMALLOC_CACHE(512),
-        KMALLOC_CACHE(1024),
-        KMALLOC_CACHE(2048),
-        KMALLOC_CACHE(4096),
-        KMALLOC_CACHE(8192)
-};
-
-/* We use this to keep track of big kmallocs which go directly to the
- * system pager. */
-typedef struct kmalloc_record {
-        void *vaddr;
-        unsigned int order;
-        unsigned int ind;
-        struct list_head list;
-} kmalloc_record_t;
-
-static void
-kmalloc_record_ctor(void *p, __attribute__((unused)) size_t sz)
-{
-        kmalloc_record_t *bp = (kmalloc_record_t *)p;
-        bp->vaddr = 0;
-        bp->order = 0;
-        bp->ind   = -1;
-        list_head_init(&bp->list);
-}
-
-static void
-kmalloc_record_dtor(void *p, __attribute__((unused)) size_t sz)
-{
-        kmalloc_record_t *bp = (kmalloc_record_t *)p;
-        list_del(&bp->list);
-}
-
-#define KMALLOC_NUM_BUCKETS 113
-static struct list_head kmalloc_record_buckets[KMALLOC_NUM_BUCKETS];
+/* Named caches are never merged into the general purpose ones. */
+#define KMALLOC_CACHE(sz)                                       \
+        KMALLOC_CACHE_FLAGS("kmalloc_"#sz, sz, SLAB_CACHE_NOMERGE)
+#define KMALLOC_DMA_CACHE(sz)                                   \
+        KMALLOC_CACHE_FLAGS("kmalloc_dma_"#sz, sz,              \
+                            SLAB_CACHE_DMA | SLAB_CACHE_NOMERGE)
 
-static struct list_head *
-select_kmalloc_record_bucket(void *vaddr)
-{
-        uint32_t h = jenkins_hash32(&vaddr, sizeof(void *), 0xdeadbeef);
-        return &kmalloc_record_buckets[h % KMALLOC_NUM_BUCKETS];
-}
+#define KMALLOC_CACHES(C)                                       \
+        C(4), C(8), C(16), C(32), C(64), C(96), C(128), C(192), \
+        C(256), C(384), C(512), C(768), C(1024), C(1536),       \
+        C(2048), C(3072), C(4096), C(8192)
 
-static kmalloc_record_t *
-find_kmalloc_record(void *vaddr)
-{
-        struct list_head *buk = select_kmalloc_record_bucket(vaddr);
-        kmalloc_record_t *p;
-        list_foreach_entry(buk, p, list)
-        {
-                if (p->vaddr == vaddr)
-                        return p;
-        }
-        return NULL;
-}
-
-static void
-add_kmalloc_record(kmalloc_record_t *bp)
-{
-        struct list_head *buk = select_kmalloc_record_bucket(bp->vaddr);
-        list_add(buk, &bp->list);
-}
+/* The M_DMA caches mirror the others, size for size. */
+static mem_cache_t malloc_caches[] = { KMALLOC_CACHES(KMALLOC_CACHE) };
+static mem_cache_t dma_malloc_caches[] = { KMALLOC_CACHES(KMALLOC_DMA_CACHE) };
 
 static vma_t vma = {
         .num_caches         = 0,
         .cache_list         = LIST_HEAD_INIT(vma.cache_list),
         .kmalloc_caches     = malloc_caches,
+        .kmalloc_dma_caches = dma_malloc_caches,
         .num_kmalloc_caches = sizeof(malloc_caches) / sizeof(mem_cache_t),
-        .reap_scanh         = NULL
+        .shrink_caches      = LIST_HEAD_INIT(vma.shrink_caches),
+        .nr_shrinkable      = 0,
 };
 
 static void
 slab_add_cache(mem_cache_t *cp)
 {
         list_add(&vma.cache_list, &cp->cache_list);
-        if (vma.reap_scanh == NULL)
-                vma.reap_scanh = &cp->cache_list;
         vma.num_caches++;
 }
 
-/* Sets cp->size, cp->pf_order, cp->num, cp->align.
+/* Count a slab that went onto, or came off, the empty list of cp. A
+ * cache is on the shrinker's list for as long as it has empty slabs,
+ * unless it is never to be reaped. */
+static inline void
+cache_empty_inc(mem_cache_t *cp)
+{
+        if (cp->flags & SLAB_CACHE_NOREAP) {
+                cp->nr_empty++;
+                return;
+        }
+        if (cp->nr_empty++ == 0)
+                list_add_tail(&vma.shrink_caches, &cp->shrink_list);
+        vma.nr_shrinkable += 1UL << cp->pf_order;
+}
+
+static inline void
+cache_empty_dec(mem_cache_t *cp)
+{
+        if (cp->flags & SLAB_CACHE_NOREAP) {
+                cp->nr_empty--;
+                return;
+        }
+        if (--cp->nr_empty == 0)
+                list_del(&cp->shrink_list);
+        vma.nr_shrinkable -= 1UL << cp->pf_order;
+}
+
+/* The distance between slab colors. Slots are cp->align apart from a
+ * page boundary, so the objects are aligned to the largest power of two
+ * that divides cp->align, and colors must keep to that. */
+static inline unsigned long
+slab_color_step(mem_cache_t *cp)
+{
+        return MAX(cp->align & -cp->align, CACHELINE_SZ);
+}
+
+/* Sets cp->size, cp->pf_order, cp->num, cp->align, cp->colors.
  * Assumes that cp->flags are set. */
 static unsigned long
 compute_slab_wastage(mem_cache_t *cp, size_t min_align)
 {
         unsigned long wastage = 0;
-        unsigned long waste_per_obj = 0;
+        unsigned long waste_per_obj;
 
         /* Sanity check some critical cache values. */
         bug_on(cp->obj_size == 0, "compute_slab_wastage called with "
                                   "obj_size=0");
 
-        /* Size and alignment are easy. */
+        /* Size and alignment are easy. Every object has to be able to
+         * hold a freelist link. */
         if (min_align < cp->obj_size)
                 min_align = cp->obj_size;
-        if (cp->flags & SLAB_CACHE_SLABOFF) {
-                cp->align = MAX(cp->obj_size, min_align);
-        } else {
-                cp->align = MAX(cp->obj_size + sizeof(slab_buf_t), min_align);
-                waste_per_obj = cp->align - cp->obj_size;
-        }
+        cp->align = MAX(min_align, sizeof(slab_free_t));
+        cp->align = (cp->align + sizeof(slab_free_t) - 1)
+                    & ~(sizeof(slab_free_t) - 1);
+        waste_per_obj = cp->align - cp->obj_size;
 
         /* Now we can work out the number of objects per cache and its
          * pf_order simultaneously.
@@ -385,8 +349,11 @@ compute_slab_wastage(mem_cache_t *cp, size_t min_align)
                 wastage += sizeof(slab_t);
                 total_slabsize -= sizeof(slab_t);
         }
-        cp->pf_order = MIN(PFA_MAX_PAGE_ORDER,
-                           LOG2(total_slabsize / PAGE_SIZE));
+        if (total_slabsize < PAGE_SIZE)
+                cp->pf_order = 0;
+        else
+                cp->pf_order = MIN(PFA_MAX_PAGE_ORDER,
+                                   LOG2(total_slabsize / PAGE_SIZE));
         if (cp->flags & SLAB_CACHE_SLABOFF) {
                 cp->num = (PAGE_SIZE<<cp->pf_order)/cp->align;
         } else {
@@ -394,8 +361,17 @@ compute_slab_wastage(mem_cache_t *cp, size_t min_align)
                            / cp->align;
         }
 
+        bug_on(cp->num >= SLAB_FREE_END, "Too many objects per slab");
+
         wastage += waste_per_obj * cp->num;
         wastage += (PAGE_SIZE<<cp->pf_order) - (cp->num * cp->align);
+
+        /* Whatever is left over at the end of a slab is used to start
+         * successive slabs at different cache lines, so that their
+         * objects do not all compete for the same cache sets. */
+        cp->colors = ((PAGE_SIZE<<cp->pf_order) - (cp->num * cp->align)
+                      - (cp->flags & SLAB_CACHE_SLABOFF ? 0 : sizeof(slab_t)))
+                     / slab_color_step(cp) + 1;
         return wastage;
 }
 
@@ -413,6 +389,7 @@ slab_init_cache(mem_cache_t *cp,
         cp->wastage  = compute_slab_wastage(cp, align);
         cp->refct    = 0;
         cp->grown    = 0;
+        cp->nr_empty = 0;
         cp->obj_ctor = ctor;
         cp->obj_dtor = dtor;
         list_head_init(&cp->cache_list);
@@ -421,33 +398,61 @@ slab_init_cache(mem_cache_t *cp,
         list_head_init(&cp->slabs_empty);
 }
 
+/* Set while the slab layer is asking the PFA for pages. Reclaim that
+ * the PFA runs then must leave the caches alone, since one of them is
+ * halfway through an allocation. */
+static unsigned int slab_getpages_depth = 0;
+
+/* Small slabs are started at successive page colors, so that their
+ * first objects do not all compete for the same cache sets. */
+static unsigned long slab_next_color = 0;
+
 static void *
 slab_getpages(size_t order, mflags_t flags)
 {
-        page_t *page = pfa_alloc_pages(flags, order);
+        page_t *page;
+
+        slab_getpages_depth++;
+        page = pfa_alloc_colored(flags, order, slab_next_color << PAGE_SHIFT);
+        slab_getpages_depth--;
+        slab_next_color += 1UL << order;
         if (!page)
                 return NULL;
-        paddr_t phys = page_to_phys(page);
-        vaddr_t vaddr = _va(phys);
-        if (pmm_map_range(proc_current()->control.pmm, vaddr,
-                          1<<order, phys, flags, PFLAGS_RW)) {
-                pfa_free_pages(page, order);
-                return NULL;
-        }
-        if (flags & M_ZERO) {
-                memset((void *)vaddr, 0, 1<<order);
-        }
+        /* Slabs are low (or DMA) memory, which the linear map always
+         * covers; mapping or unmapping it here would tear holes in the
+         * kernel's own mapping of the frames. */
+        vaddr_t vaddr = _va(page_to_phys(page));
+        if ((flags & M_ZERO) && !(page->flags & PG_ZERO))
+                memset((void *)vaddr, 0, PAGE_SIZE<<order);
+        page->flags &= ~PG_ZERO;
         return (void *)vaddr;
 }
 
 static void
 slab_freepages(void *p, size_t order)
 {
-        paddr_t phys;
-        pmm_unmap_range(proc_current()->control.pmm, (vaddr_t)p,
-                        1<<order, &phys);
-        page_t *page = phys_to_page(phys);
-        pfa_free_pages(page, order);
+        pfa_free_pages(phys_to_page(_pa(p)), order);
+}
+
+/* A cache that cp can be merged into: one with objects of the same size
+ * in slots of the same size, with the same flags, whose objects need no
+ * setting up. */
+static mem_cache_t *
+cache_find_merge(mem_cache_t *cp)
+{
+        mem_cache_t *root;
+
+        list_foreach_entry(&vma.cache_list, root, cache_list)
+        {
+                if (root->merged || root->obj_ctor || root->obj_dtor ||
+                    (root->flags & SLAB_CACHE_NOMERGE))
+                        continue;
+                if (root->align == cp->align &&
+                    root->obj_size == cp->obj_size &&
+                    root->flags == cp->flags)
+                        return root;
+        }
+        return NULL;
 }
 
 mem_cache_t *
@@ -472,24 +477,36 @@ mem_cache_create(const char *name, size_t size, size_t align,
                 return NULL;
         }
         slab_init_cache(cachep, name, size, align, flags, ctor, dtor);
+        if (!ctor && !dtor && !(flags & SLAB_CACHE_NOMERGE))
+                cachep->merged = cache_find_merge(cachep);
+        if (cachep->merged)
+                cachep->merged->refct++;
         slab_add_cache(cachep);
         return cachep;
 }
 
+/* Point the page structs of the slab's frames at sp (or NULL). */
 static void
-slab_destroy(mem_cache_t *cp, slab_t *sp)
+slab_set_pages(mem_cache_t *cp, void *buf, slab_t *sp)
 {
+        page_t *page = phys_to_page(_pa(buf));
         unsigned long i;
-        void *p = sp->buf;
-        /* First of all, destroy each slab object. */
-        for (i = 0; i < sp->num; i++)
-        {
-                if (cp->obj_dtor)
-                        cp->obj_dtor(p, cp->obj_size);
-                p = (char *)p + cp->align;
-        }
+
+        /* A slab never crosses a memory section, so its page structs
+         * are next to each other. */
+        for (i = 0; i < (1UL << cp->pf_order); i++)
+                page[i].slab = sp;
+}
+
+static void
+slab_destroy(mem_cache_t *cp, slab_t *sp)
+{
+        /* Every object has already been through the destructor in
+         * mem_cache_free, so running it again here would tear down
+         * state that no longer belongs to the object. */
         /* Give the slab's pages back to the kernel. */
-        slab_freepages(sp->buf, cp->pf_order);
+        slab_set_pages(cp, slab_base(sp), NULL);
+        slab_freepages(slab_base(sp), cp->pf_order);
         /* If we keep book-keeping off-slab, make sure we remove that
          * too. */
         if (cp->flags & SLAB_CACHE_SLABOFF)
@@ -504,16 +521,32 @@ cache_unused(mem_cache_t *cp)
                 list_empty(&cp->slabs_empty));
 }
 
-static void
-cache_reap_empty(mem_cache_t *cp)
+/* Objects handed out by the cache and not yet given back. */
+static inline unsigned long
+cache_active(mem_cache_t *cp)
+{
+        return cp->nr_allocs - cp->nr_frees;
+}
+
+/* Destroy the empty slabs of the cache, least recently emptied first,
+ * until at least 'nr' pages are freed or none are left. Returns the
+ * number of pages freed. */
+static unsigned long
+cache_shrink(mem_cache_t *cp, unsigned long nr)
 {
-        slab_t *sp, *s;
+        unsigned long freed = 0;
 
-        list_foreach_entry_safe(&cp->slabs_empty, sp, s, slab_list)
+        while (cp->nr_empty && freed < nr)
         {
+                slab_t *sp = list_last_entry(&cp->slabs_empty, slab_t,
+                                             slab_list);
                 list_del(&sp->slab_list);
+                cache_empty_dec(cp);
                 slab_destroy(cp, sp);
+                cp->nr_reaps++;
+                freed += 1UL << cp->pf_order;
         }
+        return freed;
 }
 
 int
@@ -524,341 +557,728 @@ mem_cache_destroy(mem_cache_t *cp)
         if (cp == NULL)
                 return 1;
 
-        cache_reap_empty(cp);
+        /* A merged cache only has to give back its name, and the cache
+         * that it was merged into has to outlive it. */
+        if (cp->merged) {
+                if (cache_active(cp)) {
+                        kprintf(PRI_ERR, "Cannot destroy cache (in use)\n");
+                        return 1;
+                }
+                cp->merged->refct--;
+                mem_cache_free(&vma.cache_cache, cp);
+                vma.num_caches--;
+                return 0;
+        }
+        if (cp->refct) {
+                kprintf(PRI_ERR, "Cannot destroy cache (merged into)\n");
+                return 1;
+        }
+
+        cache_flush_mags(cp);
+        cache_shrink(cp, ~0UL);
         if (!cache_unused(cp)) {
                 kprintf(PRI_ERR, "Cannot destroy cache (in use)\n");
                 return 1;
         }
-        if (vma.reap_scanh == &cp->cache_list)
-                vma.reap_scanh = cp->cache_list.next;
         mem_cache_free(&vma.cache_cache, cp);
         vma.num_caches--;
         return 0;
 }
 
-static int
-slab_init_objects(mem_cache_t *cp, slab_t *sp, mflags_t lflags)
+/* Threads every object of a fresh slab onto its freelist. */
+static void
+slab_init_objects(mem_cache_t *cp, slab_t *sp)
 {
-        void *p;
         unsigned long i;
 
-        if (cp->flags & SLAB_CACHE_SLABOFF) {
-                sp->slab_bufs = mem_cache_alloc(&vma.slab_buf_cache,
-                                                 lflags);
-                if (!sp->slab_bufs)
-                        return 1;
-        } else {
-                sp->slab_bufs = NULL;
-        }
-
-        p = slab_data(cp, sp);
-        for (i = 0; i < cp->num; i++) {
-                slab_buf_t *bp;
-                void *data = ((char *)p + (i * cp->align));
-                if (cp->obj_ctor)
-                        cp->obj_ctor(data, cp->obj_size);
-                if (cp->flags & SLAB_CACHE_SLABOFF) {
-                        bp = &sp->slab_bufs[i];
-                } else {
-                        bp = slab_buf_hdr((char *)sp->buf
-                                + (i * cp->align));
-                        slab_buf_ctor(bp, 0);
-                }
-                bp->buf = data;
-                bp->sp  = sp;
-                if (!sp->freep) {
-                        sp->freep = sp->lastp = bp;
-                } else {
-                        sp->lastp->next = bp;
-                        sp->lastp = bp;
-                }
-        }
-        return 0;
+        for (i = 0; i < cp->num; i++)
+                slab_obj_next(slab_obj(cp, sp, i))
+                        = (i + 1 < cp->num ? i + 1 : SLAB_FREE_END);
+        sp->free = 0;
 }
 
 static slab_t *
 mem_cache_allocmgmt(mem_cache_t *cp, void *objp, mflags_t lflags)
 {
         slab_t *sp;
+        unsigned long color = cp->color_next * slab_color_step(cp);
+
         if (cp->flags & SLAB_CACHE_SLABOFF) {
                sp = mem_cache_alloc(&vma.mem_cache, lflags);
                if (!sp)
                        return NULL;
         } else {
-               sp = (slab_t *)((char *)objp + (cp->num * cp->align));
-               slab_ctor(sp, sizeof(slab_t));
-        }
-        sp->buf = objp;
-        if (slab_init_objects(cp, sp, lflags)) {
-                slab_dtor(sp, sizeof(slab_t));
-                if (cp->flags & SLAB_CACHE_SLABOFF)
-                        mem_cache_free(&vma.mem_cache, sp);
-                return NULL;
+               sp = (slab_t *)((char *)objp + color
+                               + (cp->num * cp->align));
         }
+        if (++cp->color_next == cp->colors)
+                cp->color_next = 0;
+        /* An off-slab slab_t may be a recycled one whose freelist still
+         * points into pages that have since been freed. */
+        slab_ctor(sp, sizeof(slab_t));
+        sp->cp    = cp;
+        sp->color = color;
+        sp->buf   = (char *)objp + color;
+        slab_init_objects(cp, sp);
+        slab_set_pages(cp, objp, sp);
         return sp;
 }
 
-static slab_buf_t *
-slab_find_free(slab_t *sp)
+/* Moves sp onto the list for the number of objects it has in use. */
+static void
+slab_relink(mem_cache_t *cp, slab_t *sp)
 {
-        return sp->freep;
+        struct list_head *head;
+        slab_state_t state;
+
+        if (sp->num == 0) {
+                state = SLAB_STATE_EMPTY;
+                head = &cp->slabs_empty;
+        } else if (sp->num == cp->num) {
+                state = SLAB_STATE_FULL;
+                head = &cp->slabs_full;
+        } else {
+                state = SLAB_STATE_PARTIAL;
+                head = &cp->slabs_partial;
+        }
+        if (state == sp->state)
+                return;
+        if (sp->state == SLAB_STATE_EMPTY)
+                cache_empty_dec(cp);
+        if (state == SLAB_STATE_EMPTY)
+                cache_empty_inc(cp);
+        list_del(&sp->slab_list);
+        list_add(head, &sp->slab_list);
+        sp->state = state;
 }
 
-void *
-mem_cache_alloc(mem_cache_t *cp, mflags_t flags)
+/* Adds a new, empty slab to the cache. */
+static slab_t *
+slab_grow(mem_cache_t *cp, mflags_t flags)
 {
-        slab_buf_t *bp;
+        slab_t *sp;
 
-        if (!cp || BAD_MFLAGS_FOR_VMM(flags))
+        /* Objects are zeroed one at a time as they are handed out, and
+         * the zone is the cache's to choose. */
+        mflags_t pflags = flags & ~(M_ZERO | M_DMA);
+        if (cp->flags & SLAB_CACHE_DMA)
+                pflags |= M_DMA;
+        void *buf = slab_getpages(cp->pf_order, pflags);
+        if (!buf)
+                return NULL;
+        sp = mem_cache_allocmgmt(cp, buf, flags & ~M_DMA);
+        if (!sp) {
+                slab_freepages(buf, cp->pf_order);
                 return NULL;
+        }
+        list_add(&cp->slabs_empty, &sp->slab_list);
+        cache_empty_inc(cp);
+        cp->nr_grows++;
+        return sp;
+}
+
+/* Takes up to n objects from the slabs of the cache, growing it if
+ * need be. Each slab changes lists at most once per call. Returns the
+ * number of objects taken. */
+static unsigned long
+slab_alloc_bulk(mem_cache_t *cp, mflags_t flags, unsigned long n,
+                void **objs)
+{
+        unsigned long got = 0;
 
-        /* First, see if we have a partial slab to use. */
-        slab_t *sp = list_first_entry_or_null(&cp->slabs_partial,
+        while (got < n) {
+                unsigned long i, take;
+                slab_t *sp;
+
+                /* First, see if we have a partial slab to use. Then
+                 * check the empty list, and let this cache be reaped if
+                 * there is something on it. */
+                sp = list_first_entry_or_null(&cp->slabs_partial,
                                               slab_t, slab_list);
-        if (sp) {
-                if (++sp->num == cp->num) {
-                        /* Send this over to the full slab list. */
-                        list_del(&sp->slab_list);
-                        list_add(&cp->slabs_full, &sp->slab_list);
-                        sp->state = SLAB_STATE_FULL;
+                if (!sp) {
+                        sp = list_first_entry_or_null(&cp->slabs_empty,
+                                                      slab_t, slab_list);
+                        if (sp)
+                                cp->grown = 0;
+                }
+                /* Alas, there are no slabs for us. We have to create a
+                 * new one. Prevent reaping until either an alloc
+                 * happens, or until the slab is a reap candidate
+                 * twice. */
+                if (!sp) {
+                        sp = slab_grow(cp, flags);
+                        if (!sp)
+                                break;
+                        cp->grown = 1;
                 }
-                goto out;
+
+                take = MIN(n - got, cp->num - sp->num);
+                for (i = 0; i < take; i++)
+                {
+                        if (sp->free == SLAB_FREE_END) {
+                                kprintf(PRI_ERR, "Slab %s has no records!\n",
+                                        cp->name);
+                        }
+                        bug_on(sp->free == SLAB_FREE_END,
+                               "No free object found (slab corrupted?)");
+                        objs[got] = slab_obj(cp, sp, sp->free);
+                        sp->free = slab_obj_next(objs[got]);
+                        got++;
+                }
+                sp->num += take;
+                slab_relink(cp, sp);
         }
+        return got;
+}
 
-        /* Check the empty list. */
-        sp = list_first_entry_or_null(&cp->slabs_empty, slab_t, slab_list);
-        if (sp) {
-                ++sp->num;
-                /* Send this to the partial list. */
-                list_del(&sp->slab_list);
-                list_add(&cp->slabs_partial, &sp->slab_list);
-                sp->state = SLAB_STATE_PARTIAL;
-                /* Let this cache be reaped. */
-                cp->grown = 0;
-                goto out;
+/* Gives n objects back to their slabs. The destructor has already been
+ * run. Objects from the same slab that are next to each other in objs
+ * move it between lists only once. */
+static void
+slab_free_bulk(mem_cache_t *cp, unsigned long n, void **objs)
+{
+        slab_t *last = NULL;
+        unsigned long i;
+
+        for (i = 0; i < n; i++)
+        {
+                void *obj = objs[i];
+                unsigned long ind;
+                slab_t *sp;
+
+                sp = slab_of(obj);
+                if (!sp || sp->cp != cp ||
+                    (ind = slab_obj_index(cp, sp, obj)) == cp->num) {
+                        kprintf(PRI_ERR,
+                                "mem_cache_free: No record found.\n");
+                        continue;
+                }
+                if (sp != last && last)
+                        slab_relink(cp, last);
+                last = sp;
+
+                if (sp->num == 0) {
+                        kprintf(PRI_ERR,
+                                "mem_cache_free: Empty slab (double free?)\n");
+                        continue;
+                }
+
+                /* Push the object onto the freelist. */
+                slab_obj_next(obj) = sp->free;
+                sp->free = ind;
+                --sp->num;
         }
+        if (last)
+                slab_relink(cp, last);
+}
 
-        /* Alas, there are no slabs for us. We have to create a new one. */
-        void *buf = slab_getpages(cp->pf_order, flags);
-        if (!buf)
+/* Whether obj is an object in one of cp's slabs. A magazine would take
+ * anything it is handed and give it out again, so frees are checked
+ * here before they get that far. */
+static int
+cache_owns(mem_cache_t *cp, void *obj)
+{
+        slab_t *sp = slab_of(obj);
+
+        return sp && sp->cp == cp && slab_obj_index(cp, sp, obj) != cp->num;
+}
+
+/* The magazines of the running CPU, or NULL if the cache has none. */
+static slab_cpu_t *
+cache_cpu(mem_cache_t *cp)
+{
+        unsigned int id;
+
+        if (cp->flags & SLAB_CACHE_NOMAG)
                 return NULL;
-        sp = mem_cache_allocmgmt(cp, buf, flags);
-        if (!sp) {
-                slab_freepages(buf, cp->pf_order);
+        id = cpu_current()->id;
+        return id < SLAB_MAX_CPUS ? &cp->cpus[id] : NULL;
+}
+
+/* Takes an object from the magazines of a CPU. If both are empty, the
+ * previous one goes to the depot in exchange for a full one. Returns
+ * NULL if the depot has no full magazines either. */
+static void *
+mag_alloc(mem_cache_t *cp, slab_cpu_t *cc)
+{
+        slab_mag_t *mp;
+
+        if (cc->loaded && cc->loaded->rounds > 0)
+                return cc->loaded->objs[--cc->loaded->rounds];
+        if (cc->previous && cc->previous->rounds > 0) {
+                /* The previous magazine is always full or empty. */
+                mp = cc->previous;
+                cc->previous = cc->loaded;
+                cc->loaded = mp;
+                return mp->objs[--mp->rounds];
+        }
+
+        mp = list_first_entry_or_null(&cp->mags_full, slab_mag_t, list);
+        if (!mp)
                 return NULL;
+        list_del(&mp->list);
+        --cp->nr_mags_full;
+        if (cc->previous)
+                list_add(&cp->mags_empty, &cc->previous->list);
+        cc->previous = cc->loaded;
+        cc->loaded = mp;
+        return mp->objs[--mp->rounds];
+}
+
+/* Puts an object into the magazines of a CPU. If both are full, the
+ * previous one goes to the depot in exchange for an empty one. Returns
+ * nonzero if no empty magazine could be found, in which case the object
+ * has to go back to its slab. */
+static int
+mag_free(mem_cache_t *cp, slab_cpu_t *cc, void *obj)
+{
+        slab_mag_t *mp;
+
+        if (cc->loaded && cc->loaded->rounds < SLAB_MAG_ROUNDS) {
+                cc->loaded->objs[cc->loaded->rounds++] = obj;
+                return 0;
+        }
+        if (cc->previous && cc->previous->rounds == 0) {
+                mp = cc->previous;
+                cc->previous = cc->loaded;
+                cc->loaded = mp;
+                mp->objs[mp->rounds++] = obj;
+                return 0;
         }
-        ++sp->num;
-        list_add(&cp->slabs_partial, &sp->slab_list);
-        sp->state = SLAB_STATE_PARTIAL;
-        /* Prevent reaping until either an alloc happens, or until
-         * the slab is a reap candidate twice. */
-        cp->grown = 1;
-out:
-        bp = slab_find_free(sp);
-        if (!bp) {
-                kprintf(PRI_ERR, "Slab %s has no records!\n", cp->name);
+
+        mp = list_first_entry_or_null(&cp->mags_empty, slab_mag_t, list);
+        if (mp) {
+                list_del(&mp->list);
+        } else {
+                mp = mem_cache_alloc(&vma.mag_cache, M_KERNEL);
+                if (!mp)
+                        return 1;
+                mp->rounds = 0;
+        }
+        if (cc->previous) {
+                list_add(&cp->mags_full, &cc->previous->list);
+                ++cp->nr_mags_full;
         }
-        bug_on(!bp, "No free object found (slab corrupted?)");
-        sp->freep = bp->next;
-        add_to_slab_map(cp, bp);
-        return bp->buf;
+        cc->previous = cc->loaded;
+        cc->loaded = mp;
+        mp->objs[mp->rounds++] = obj;
+        return 0;
 }
 
-void
-mem_cache_free(mem_cache_t *cp, void *obj)
+/* Returns the objects in a magazine to their slabs, and frees it. */
+static void
+mag_destroy(mem_cache_t *cp, slab_mag_t *mp)
 {
-        slab_buf_t *bp;
-        slab_t *sp;
+        while (mp->rounds > 0)
+                slab_free_bulk(cp, 1, &mp->objs[--mp->rounds]);
+        mem_cache_free(&vma.mag_cache, mp);
+}
 
-        if (!cp || !obj)
-                return;
+/* Empties the depot of the cache. The magazines loaded on each CPU are
+ * left alone. */
+static void
+cache_drain_depot(mem_cache_t *cp)
+{
+        slab_mag_t *mp, *m;
 
-        bp = find_slab_buf(cp, obj);
-        if (!bp) {
-                kprintf(PRI_ERR, "mem_cache_free: No record found.\n");
-                return;
+        list_foreach_entry_safe(&cp->mags_full, mp, m, list)
+        {
+                list_del(&mp->list);
+                mag_destroy(cp, mp);
         }
-        sp = bp->sp;
+        cp->nr_mags_full = 0;
+        list_foreach_entry_safe(&cp->mags_empty, mp, m, list)
+        {
+                list_del(&mp->list);
+                mag_destroy(cp, mp);
+        }
+}
 
-        if (sp->num == 0) {
-                kprintf(PRI_ERR, "mem_cache_free: Empty slab (double free?)\n");
-                return;
+/* Empties every magazine of the cache, including the ones loaded on
+ * other CPUs, so nothing else may be using the cache. */
+static void
+cache_flush_mags(mem_cache_t *cp)
+{
+        unsigned int i;
+
+        for (i = 0; i < SLAB_MAX_CPUS; i++)
+        {
+                slab_cpu_t *cc = &cp->cpus[i];
+                if (cc->loaded)
+                        mag_destroy(cp, cc->loaded);
+                if (cc->previous)
+                        mag_destroy(cp, cc->previous);
+                cc->loaded = cc->previous = NULL;
         }
+        cache_drain_depot(cp);
+}
 
+/* Takes n objects from the CPU's magazines, then the slabs. Returns
+ * the number of objects taken. */
+static unsigned long
+cache_get(mem_cache_t *cp, mflags_t flags, unsigned long n, void **objs)
+{
+        slab_cpu_t *cc = cache_cpu(cp);
+        unsigned long got = 0;
+
+        while (cc && got < n && (objs[got] = mag_alloc(cp, cc)))
+                got++;
+        if (got < n)
+                got += slab_alloc_bulk(cp, flags, n - got, objs + got);
+        return got;
+}
 
-        if (cp->obj_dtor)
-                cp->obj_dtor(obj, cp->obj_size);
+/* Puts n destructed objects into the CPU's magazines, or back on their
+ * slabs once the magazines are full. */
+static void
+cache_put(mem_cache_t *cp, unsigned long n, void **objs)
+{
+        slab_cpu_t *cc = cache_cpu(cp);
+        unsigned long i = 0;
 
-        /* Put the slab buffer object back into the freelist. */
-        if (!sp->freep) {
-                sp->freep = sp->lastp = bp;
-        } else {
-                bug_on(!sp->lastp, "Last pointer not set.");
-                sp->lastp->next = bp;
-                sp->lastp = bp;
-                bp->next = NULL;
+        while (cc && i < n && !mag_free(cp, cc, objs[i]))
+                i++;
+        if (i < n)
+                slab_free_bulk(cp, n - i, objs + i);
+}
+
+/* Free objects hold freelist links, and have been through the
+ * destructor, so they are set up afresh each time. */
+static void
+cache_obj_init(mem_cache_t *cp, void *obj, mflags_t flags)
+{
+        if (flags & M_ZERO)
+                memset(obj, 0, cp->obj_size);
+        if (cp->obj_ctor)
+                cp->obj_ctor(obj, cp->obj_size);
+}
+
+void *
+mem_cache_alloc(mem_cache_t *cp, mflags_t flags)
+{
+        slab_cpu_t *cc;
+        void *obj;
+
+        if (!cp || BAD_MFLAGS_FOR_VMM(flags))
+                return NULL;
+
+        if (cp->merged) {
+                obj = mem_cache_alloc(cp->merged, flags);
+                if (obj)
+                        cp->nr_allocs++;
+                return obj;
         }
+        cc = cache_cpu(cp);
+        if ((!cc || !(obj = mag_alloc(cp, cc))) &&
+            !slab_alloc_bulk(cp, flags, 1, &obj))
+                return NULL;
+        cache_obj_init(cp, obj, flags);
+        cp->nr_allocs++;
+        return obj;
+}
 
-        /* Make sure we move the slab into the correct list. */
-        if (sp->num == cp->num) {
-                list_del(&sp->slab_list);
-                list_add(&cp->slabs_partial, &sp->slab_list);
-                sp->state = SLAB_STATE_PARTIAL;
+int
+mem_cache_alloc_bulk(mem_cache_t *cp, mflags_t flags, size_t n,
+                     void **objs)
+{
+        unsigned long got, i;
+
+        if (!cp || !objs || BAD_MFLAGS_FOR_VMM(flags))
+                return 1;
+
+        if (cp->merged) {
+                if (mem_cache_alloc_bulk(cp->merged, flags, n, objs))
+                        return 1;
+                cp->nr_allocs += n;
+                return 0;
         }
-        if (--sp->num == 0) {
-                list_del(&sp->slab_list);
-                list_add(&cp->slabs_empty, &sp->slab_list);
-                sp->state = SLAB_STATE_EMPTY;
+        got = cache_get(cp, flags, n, objs);
+        if (got < n) {
+                /* None of these have been constructed yet. */
+                cache_put(cp, got, objs);
+                return 1;
         }
+        for (i = 0; i < n; i++)
+                cache_obj_init(cp, objs[i], flags);
+        cp->nr_allocs += n;
+        return 0;
 }
 
 void
-slab_reap(void)
+mem_cache_free(mem_cache_t *cp, void *obj)
 {
-        #define REAP_SCANLEN 10 /* Only scan 10 caches per reap */
+        mem_cache_t *root;
+        slab_cpu_t *cc;
 
-        mem_cache_t *cp;
-        mem_cache_t *to_reap = NULL;
-        unsigned int i = 0;
-        unsigned int best_num_free = 0;
+        if (!cp || !obj)
+                return;
+
+        root = cp->merged ? cp->merged : cp;
+        if (!cache_owns(root, obj)) {
+                kprintf(PRI_ERR, "mem_cache_free: No record found.\n");
+                return;
+        }
+        if (cp->merged) {
+                cp->nr_frees++;
+                cp = cp->merged;
+        }
+        cp->nr_frees++;
+        if (cp->obj_dtor)
+                cp->obj_dtor(obj, cp->obj_size);
+        cc = cache_cpu(cp);
+        if (!cc || mag_free(cp, cc, obj))
+                slab_free_bulk(cp, 1, &obj);
+}
 
-        if (vma.num_caches == 0)
+void
+mem_cache_free_bulk(mem_cache_t *cp, size_t n, void **objs)
+{
+        mem_cache_t *root;
+        size_t i, j, bad = 0;
+
+        if (!cp || !objs)
                 return;
-        bug_on(vma.reap_scanh == NULL, "VMA in invalid state.");
 
-        /* We scan from the previous entry to the reap_scanh since
-         * otherwise we would skip that entry. */
-        list_foreach_entry(vma.reap_scanh->prev, cp, cache_list)
+        root = cp->merged ? cp->merged : cp;
+        /* Foreign objects are left out, and split the batch into runs
+         * that are put back one at a time. */
+        for (i = j = 0; i < n; i++)
         {
-                unsigned full_free = 0;
-                /* Ensure that we're not scanning the head pointer,
-                 * which is in our vma struct and *not* a cache struct. */
-                if (&cp->cache_list == &vma.cache_list)
-                        continue;
-                if (++i > REAP_SCANLEN)
-                        break;
-                if (cp->flags & SLAB_CACHE_NOREAP)
-                        continue;
-                if (cp->grown) {
-                        cp->grown = 0;
+                if (cache_owns(root, objs[i])) {
+                        if (root->obj_dtor)
+                                root->obj_dtor(objs[i], root->obj_size);
                         continue;
                 }
+                kprintf(PRI_ERR, "mem_cache_free: No record found.\n");
+                cache_put(root, i - j, objs + j);
+                j = i + 1;
+                bad++;
+        }
+        cache_put(root, n - j, objs + j);
 
-                full_free = list_size(&cp->slabs_empty);
-                if (full_free > 0) {
-                        /* If there are at least 10 free slabs, just
-                         * take this cache and tidy up. */
-                        if (full_free > 10) {
-                                to_reap = cp;
+        if (cp->merged)
+                cp->nr_frees += n - bad;
+        root->nr_frees += n - bad;
+}
+
+unsigned long
+slab_shrink(unsigned long nr)
+{
+        mem_cache_t *cp, *next;
+        unsigned long freed = 0;
+        int pass;
+
+        /* Objects sitting in the depots keep their slabs from emptying,
+         * so give them back first if the empty slabs will not do. */
+        if (vma.nr_shrinkable < nr)
+                list_foreach_entry(&vma.cache_list, cp, cache_list)
+                        cache_drain_depot(cp);
+
+        /* A cache that had to grow since the shrinker last came by is
+         * likely to need its empty slabs again soon, so it is spared
+         * unless a first pass over the others frees too little. */
+        for (pass = 0; pass < 2 && freed < nr; pass++)
+        {
+                list_foreach_entry_safe(&vma.shrink_caches, cp, next,
+                                        shrink_list)
+                {
+                        if (freed >= nr) {
+                                /* Start from here next time. */
+                                list_del(&vma.shrink_caches);
+                                list_add_tail(&cp->shrink_list,
+                                              &vma.shrink_caches);
                                 break;
                         }
-                        /* Otherwise keep scanning for a better one. */
-                        if (full_free >= best_num_free) {
-                                best_num_free = full_free;
-                                to_reap = cp;
+                        if (pass == 0 && cp->grown) {
+                                cp->grown = 0;
+                                continue;
                         }
+                        freed += cache_shrink(cp, nr - freed);
                 }
         }
-        if (&cp->cache_list == &vma.cache_list)
-                vma.reap_scanh = &vma.cache_list;
-        else
-                vma.reap_scanh = &cp->cache_list;
+        return freed;
+}
 
-        if (!to_reap)
-                return;
-        /* Alright, reap the empty slabs. */
-        cache_reap_empty(to_reap);
+/* Called by the PFA when a zone drops below its watermarks, with the
+ * number of pages that it is short. */
+static unsigned long
+slab_reclaim(unsigned long nr)
+{
+        if (slab_getpages_depth)
+                return 0;
+        return slab_shrink(nr);
 }
 
-static int
-create_kmalloc_record(mflags_t flags, void *vaddr, unsigned long order,
-                      unsigned long ind)
+static pfa_reclaimer_t slab_reclaimer = {
+        .name = "slab",
+        .reclaim = slab_reclaim,
+};
+
+/* The kmalloc cache that addr was handed out from, or NULL if it did
+ * not come from one. */
+static mem_cache_t *
+kmalloc_cache_of(void *addr)
 {
-        kmalloc_record_t *bp = mem_cache_alloc(&vma.kmalloc_record_cache,
-                                                flags);
-        if (!bp)
-                return 1;
-        bp->vaddr = vaddr;
-        bp->order = order;
-        bp->ind   = ind;
-        add_kmalloc_record(bp);
-        return 0;
+        slab_t *sp;
+
+        /* vmalloc addresses are not in the direct map. */
+        if (is_vmalloc_addr(addr))
+                return NULL;
+        sp = slab_of(addr);
+        if (!sp)
+                return NULL;
+        if (sp->cp >= vma.kmalloc_caches &&
+            sp->cp < vma.kmalloc_caches + vma.num_kmalloc_caches)
+                return sp->cp;
+        if (sp->cp >= vma.kmalloc_dma_caches &&
+            sp->cp < vma.kmalloc_dma_caches + vma.num_kmalloc_caches)
+                return sp->cp;
+        return NULL;
+}
+
+/* Size classes come in pairs: 2^o for sizes in (3 * 2^(o-2), 2^o], and
+ * 3 * 2^(o-2) for sizes in (2^(o-1), 3 * 2^(o-2)]. This is the class
+ * for a size of 2^(ord-1) < size <= 2^ord. */
+static inline unsigned long
+kmalloc_class(unsigned long size, unsigned long ord)
+{
+        return 2 * ord - (size <= (3UL << ord) >> 2);
+}
+
+/* The largest size in a class. */
+static inline unsigned long
+kmalloc_class_size(unsigned long class)
+{
+        unsigned long ord = (class + 1) / 2;
+        return (class & 1) ? (3UL << ord) >> 2 : 1UL << ord;
+}
+
+/* The kmalloc cache for 'size' bytes with the given flags, or NULL if
+ * they come from vmalloc. */
+static mem_cache_t *
+kmalloc_cache_for(unsigned long size, mflags_t flags)
+{
+        mem_cache_t *caches = (flags & M_DMA) ? vma.kmalloc_dma_caches
+                                              : vma.kmalloc_caches;
+        unsigned long ind = next_pow2(size);
+
+        /* Use the kmalloc_4 slab for 1..4 size allocs */
+        if (ind < 2)
+                ind = 2;
+        if (ind > SLAB_KMALLOC_MAX_ORD ||
+            vma.kmalloc_index[kmalloc_class(size, ind)]
+                        >= vma.num_kmalloc_caches)
+                return NULL;
+        return &caches[vma.kmalloc_index[kmalloc_class(size, ind)]];
+}
+
+/* The page order that a big kmalloc of 'size' bytes would take from
+ * the pager, had it to be physically contiguous. */
+static inline unsigned long
+kmalloc_big_order(unsigned long size)
+{
+        unsigned long ind = next_pow2(size);
+        return ind >= PAGE_SHIFT ? ind - PAGE_SHIFT : 0;
 }
 
 void *
 kmalloc(unsigned long size, mflags_t flags)
 {
-        unsigned long ind, pf_ord;
+        unsigned long ind;
+        mem_cache_t *cp;
         void *ret;
 
         if (BAD_MFLAGS_FOR_VMM(flags) || size == 0)
                 return NULL;
 
         ind = next_pow2(size);
-        pf_ord = (ind >= PAGE_SHIFT ? ind - PAGE_SHIFT : 0);
-        /* Use the kmalloc_4 slab for 1..4 size allocs */
         if (ind < 2)
                 ind = 2;
-        if (ind-2 >= vma.num_kmalloc_caches) {
-                /* Just go right to the pager. */
-                ret = slab_getpages(pf_ord, flags);
-                if (!ret)
+        cp = kmalloc_cache_for(size, flags);
+        if (!cp) {
+                /* vmalloc memory is not physically contiguous. */
+                if (flags & M_DMA)
                         return NULL;
-                if (create_kmalloc_record(flags, ret, pf_ord, ind-2)) {
-                        slab_freepages(ret, pf_ord);
+                ret = vmalloc(size, flags);
+                if (!ret)
                         return NULL;
-                }
-                vma.kmalloc_big_cache.big_bused += PAGE_SIZE<<pf_ord;
+                vma.kmalloc_big_cache.big_bused += vmalloc_size(ret);
+                vma.kmalloc_alloc_bytes += vmalloc_size(ret);
+                vma.kmalloc_pow2_bytes += PAGE_SIZE << kmalloc_big_order(size);
         } else {
-                ret = mem_cache_alloc(&vma.kmalloc_caches[ind-2], flags);
-                if (create_kmalloc_record(flags, ret, pf_ord, ind-2)) {
-                        mem_cache_free(&vma.kmalloc_caches[ind-2], ret);
+                ret = mem_cache_alloc(cp, flags);
+                if (!ret)
                         return NULL;
-                }
+                vma.kmalloc_alloc_bytes += cp->obj_size;
+                vma.kmalloc_pow2_bytes += 1UL << ind;
         }
+        vma.kmalloc_req_bytes += size;
         return ret;
-
 }
 
 void
 kfree(void *addr)
 {
-        kmalloc_record_t *bp;
+        mem_cache_t *cp;
+        unsigned long size;
 
         if (!addr)
                 return;
 
-        bp = find_kmalloc_record(addr);
-        if (!bp)
+        cp = kmalloc_cache_of(addr);
+        if (cp) {
+                mem_cache_free(cp, addr);
                 return;
-
-        if (bp->ind >= vma.num_kmalloc_caches) {
-                bug_on(vma.kmalloc_big_cache.big_bused <
-                        (unsigned long)PAGE_SIZE<<bp->order,
-                        "Not enough big bytes for freeing.");
-                vma.kmalloc_big_cache.big_bused -= PAGE_SIZE<<bp->order;
-                slab_freepages(bp->vaddr, bp->order);
-        } else {
-                mem_cache_free(&vma.kmalloc_caches[bp->ind], addr);
         }
-        mem_cache_free(&vma.kmalloc_record_cache, bp);
+
+        size = vmalloc_size(addr);
+        if (!size)
+                return;
+        bug_on(vma.kmalloc_big_cache.big_bused < size,
+                "Not enough big bytes for freeing.");
+        vma.kmalloc_big_cache.big_bused -= size;
+        vfree(addr);
 }
 
-/* TODO: Be smarter about this */
 void *
 krealloc(void *addr, unsigned long size, mflags_t flags)
 {
-        kmalloc_record_t *bp;
+        mem_cache_t *cp;
         void *ret;
-        unsigned long to_copy;
+        unsigned long to_copy, old_size;
 
-        if (!addr)
+        if (!addr || BAD_MFLAGS_FOR_VMM(flags) || size == 0)
                 return NULL;
 
-        bp = find_kmalloc_record(addr);
-        if (!bp)
+        /* Stay put if the size class does not change, or if a big
+         * allocation can be resized where it is. The old size is not
+         * known, so with M_ZERO everything past the new size is zeroed;
+         * as long as every call for the allocation passes M_ZERO, the
+         * bytes that a later growth exposes are then zero. */
+        if ((cp = kmalloc_cache_of(addr))) {
+                if (kmalloc_cache_for(size, flags) == cp) {
+                        if (flags & M_ZERO)
+                                bzero((char *)addr + size,
+                                      cp->obj_size - size);
+                        return addr;
+                }
+                to_copy = cp->obj_size;
+        } else if ((old_size = vmalloc_size(addr))) {
+                if (!(flags & M_DMA) && !kmalloc_cache_for(size, flags) &&
+                    vresize(addr, size, flags)) {
+                        vma.kmalloc_big_cache.big_bused -= old_size;
+                        vma.kmalloc_big_cache.big_bused += vmalloc_size(addr);
+                        if (flags & M_ZERO)
+                                bzero((char *)addr + size,
+                                      MIN(old_size, vmalloc_size(addr))
+                                      - MIN(old_size, size));
+                        return addr;
+                }
+                to_copy = old_size;
+        } else {
                 return NULL;
-        to_copy = MIN(((unsigned long)PAGE_SIZE << bp->order), size);
+        }
+        to_copy = MIN(to_copy, size);
 
         ret = kmalloc(size, flags);
         if (!ret)
@@ -874,42 +1294,48 @@ static void
 vma_init_kmalloc_caches(void)
 {
         unsigned long i;
-        slab_init_cache(&vma.kmalloc_record_cache, "kmalloc_rec_cache",
-                        sizeof(kmalloc_record_t), sizeof(kmalloc_record_t),
-                        0, kmalloc_record_ctor, kmalloc_record_dtor);
-        slab_add_cache(&vma.kmalloc_record_cache);
-        for (i = 0; i < vma.num_kmalloc_caches; i++)
+        for (i = 0; i < 2 * vma.num_kmalloc_caches; i++)
         {
-                mem_cache_ctor(&vma.kmalloc_caches[i], 0);
-                vma.kmalloc_caches[i].wastage
-                        = compute_slab_wastage(&vma.kmalloc_caches[i], 0);
-                slab_add_cache(&vma.kmalloc_caches[i]);
+                mem_cache_t *cp = i < vma.num_kmalloc_caches
+                        ? &vma.kmalloc_caches[i]
+                        : &vma.kmalloc_dma_caches[i - vma.num_kmalloc_caches];
+                mem_cache_ctor(cp, 0);
+                cp->wastage = compute_slab_wastage(cp, 0);
+                slab_add_cache(cp);
         }
-        for (i = 0; i < KMALLOC_NUM_BUCKETS; i++)
+        /* Each class goes to the smallest cache that it fits in, or
+         * past the end of the caches if there is none. */
+        for (i = 0; i < sizeof(vma.kmalloc_index); i++)
         {
-                list_head_init(&kmalloc_record_buckets[i]);
+                unsigned long j = 0;
+                while (j < vma.num_kmalloc_caches &&
+                       vma.kmalloc_caches[j].obj_size
+                                < kmalloc_class_size(i))
+                        j++;
+                vma.kmalloc_index[i] = j;
         }
         slab_init_cache(&vma.kmalloc_big_cache, "kmalloc_big",
-                        1, 1, 0, NULL, NULL);
+                        1, 1, SLAB_CACHE_NOMERGE, NULL, NULL);
         slab_add_cache(&vma.kmalloc_big_cache);
 }
 
 static void
 vma_init_cache_cache(void)
 {
+        /* The slab layer's own caches do without magazines, since
+         * they are used to make them. */
         slab_init_cache(&vma.cache_cache, "cache_cache",
                         sizeof(mem_cache_t), sizeof(mem_cache_t),
-                        0, mem_cache_ctor, mem_cache_dtor);
+                        SLAB_CACHE_NOMAG, mem_cache_ctor, mem_cache_dtor);
         slab_add_cache(&vma.cache_cache);
         slab_init_cache(&vma.mem_cache, "mem_cache",
                         sizeof(slab_t), sizeof(slab_t),
-                        0, slab_ctor, slab_dtor);
+                        SLAB_CACHE_NOMAG, slab_ctor, slab_dtor);
         slab_add_cache(&vma.mem_cache);
-        slab_init_cache(&vma.slab_buf_cache, "slab_buf_cache",
-                        SLAB_MAX_OBJS * sizeof(slab_buf_t),
-                        SLAB_MAX_OBJS * sizeof(slab_buf_t),
-                        0, slab_buf_ctor, NULL);
-        slab_add_cache(&vma.slab_buf_cache);
+        slab_init_cache(&vma.mag_cache, "mag_cache",
+                        sizeof(slab_mag_t), 0,
+                        SLAB_CACHE_NOMAG | SLAB_CACHE_NOMERGE, NULL, NULL);
+        slab_add_cache(&vma.mag_cache);
 }
 
 void
@@ -919,17 +1345,14 @@ vma_init(void)
         vma_init_kmalloc_caches();
         bug_on(list_size(&vma.cache_list) != vma.num_caches,
                         "Cache list has incorrect length.\n");
+        pfa_register_reclaim(&slab_reclaimer);
+        vmalloc_init();
 }
 
 static inline unsigned long
 slab_usage(mem_cache_t *cp, slab_t *sp)
 {
-        unsigned long sz_per_obj;
-        if (cp->flags & SLAB_CACHE_SLABOFF)
-                sz_per_obj = cp->obj_size;
-        else
-                sz_per_obj = cp->obj_size + sizeof(slab_buf_t);
-        return sz_per_obj *sp->num;
+        return cp->obj_size * sp->num;
 }
 
 static inline unsigned long
@@ -981,14 +1404,116 @@ vma_report(void)
         list_foreach_entry_prev(&vma.cache_list, cp, cache_list)
         {
                 i++;
+                if (cp->merged) {
+                        kprintf(0, "%18s: merged into %21s |%11s%5d objs\n",
+                                cp->name, cp->merged->name, "",
+                                cache_active(cp));
+                        continue;
+                }
                 kprintf(0,
                 "%18s: %4d empty %4d partial %4d full |%6d KiB %5d objs\n",
-                        cp->name, list_size(&cp->slabs_empty),
+                        cp->name, cp->nr_empty,
                         list_size(&cp->slabs_partial),
                         list_size(&cp->slabs_full),
-                        KB * cache_usage(cp),
+                        cache_usage(cp) / KB,
                         cache_num_records(cp));
         }
+        /* Internal fragmentation of kmalloc, as a share of the bytes
+         * handed out. */
+        if (vma.kmalloc_alloc_bytes)
+                kprintf(0, "kmalloc: %d KiB asked, %d KiB given, %d%% wasted "
+                        "(%d%% with power-of-two classes)\n",
+                        vma.kmalloc_req_bytes / KB,
+                        vma.kmalloc_alloc_bytes / KB,
+                        100 - (100 * vma.kmalloc_req_bytes)
+                                / vma.kmalloc_alloc_bytes,
+                        100 - (100 * vma.kmalloc_req_bytes)
+                                / vma.kmalloc_pow2_bytes);
+        vmalloc_report();
+}
+
+/* Free objects held in the magazines of the cache. */
+static unsigned long
+cache_mag_rounds(mem_cache_t *cp)
+{
+        slab_mag_t *mp;
+        unsigned long i, t = 0;
+
+        for (i = 0; i < SLAB_MAX_CPUS; i++)
+        {
+                if (cp->cpus[i].loaded)
+                        t += cp->cpus[i].loaded->rounds;
+                if (cp->cpus[i].previous)
+                        t += cp->cpus[i].previous->rounds;
+        }
+        list_foreach_entry(&cp->mags_full, mp, list)
+        {
+                t += mp->rounds;
+        }
+        return t;
+}
+
+static void
+cache_stat(mem_cache_t *cp, mem_cache_stat_t *st)
+{
+        unsigned long slabs;
+
+        bzero(st, sizeof(*st));
+        strlcpy(st->name, cp->name, MEM_CACHE_STAT_NAMELEN);
+        if (cp->merged)
+                strlcpy(st->merged, cp->merged->name,
+                        MEM_CACHE_STAT_NAMELEN);
+        st->obj_size = cp->obj_size;
+        st->slot_size = cp->align;
+        st->allocs = cp->nr_allocs;
+        st->frees = cp->nr_frees;
+        st->active = cache_active(cp);
+        st->cached = cache_mag_rounds(cp);
+        st->depot = cp->nr_mags_full;
+        st->grows = cp->nr_grows;
+        st->reaps = cp->nr_reaps;
+        st->slabs_full = list_size(&cp->slabs_full);
+        st->slabs_partial = list_size(&cp->slabs_partial);
+        st->slabs_empty = cp->nr_empty;
+        slabs = st->slabs_full + st->slabs_partial + st->slabs_empty;
+        st->total = slabs * cp->num;
+        st->wastage = slabs * cp->wastage;
+}
+
+size_t
+mem_cache_stats(mem_cache_stat_t *stats, size_t n)
+{
+        mem_cache_t *cp;
+        size_t i = 0;
+
+        list_foreach_entry_prev(&vma.cache_list, cp, cache_list)
+        {
+                if (i < n)
+                        cache_stat(cp, &stats[i]);
+                i++;
+        }
+        return i;
+}
+
+void
+mem_cache_dump(void)
+{
+        mem_cache_stat_t st;
+        mem_cache_t *cp;
+
+        kprintf(0, "%16s %13s %5s %7s %8s %8s %5s %5s %8s\n",
+                "cache", "active/total", "slot", "part/sl", "allocs",
+                "frees", "grows", "reaps", "wasted");
+        list_foreach_entry_prev(&vma.cache_list, cp, cache_list)
+        {
+                cache_stat(cp, &st);
+                kprintf(0, "%16s %6d/%6d %5d %3d/%3d %8d %8d %5d %5d %8d\n",
+                        st.name, st.active, st.total, st.slot_size,
+                        st.slabs_partial,
+                        st.slabs_full + st.slabs_partial + st.slabs_empty,
+                        st.allocs, st.frees, st.grows, st.reaps,
+                        st.wastage);
+        }
 }
 
 __test static void
@@ -1015,9 +1540,103 @@ vma_test_kmalloc(void)
                         n++;
                 }
         }
+
+        /* Every size goes to the smallest cache that fits it. */
+        for (j = 1; j <= 8192; j++) {
+                p = kmalloc(j, M_KERNEL);
+                mem_cache_t *cp = kmalloc_cache_of(p);
+                bug_on(!cp || cp->obj_size < j, "kmalloc cache too small");
+                bug_on(cp > vma.kmalloc_caches && (cp - 1)->obj_size >= j,
+                       "kmalloc cache too big");
+                kfree(p);
+        }
+
+        /* The size of an allocation is known from its address alone. */
+        p = kmalloc(8, M_KERNEL);
+        memset(p, 0xab, 8);
+        p = krealloc(p, 1UL << 15, M_KERNEL);
+        bug_on(!p || ((unsigned char *)p)[7] != 0xab, "krealloc lost data");
+        bug_on(!is_vmalloc_addr(p) || vmalloc_size(p) != 1UL << 15,
+               "Big kmalloc not from vmalloc");
+        kfree(p);
+        bug_on(vmalloc_size(p), "Freed kmalloc still mapped");
+
+        /* krealloc leaves an allocation where it is when it can. */
+        p = kmalloc(65, M_KERNEL);
+        bug_on(krealloc(p, 96, M_KERNEL) != p, "Moved within a class");
+        kfree(p);
+        /* With M_ZERO, growth within a class exposes only zeroes. */
+        p = kmalloc(120, M_KERNEL | M_ZERO);
+        memset(p, 0xab, 120);
+        bug_on(krealloc(p, 100, M_KERNEL | M_ZERO) != p ||
+               krealloc(p, 120, M_KERNEL | M_ZERO) != p,
+               "Moved within a class");
+        bug_on(((unsigned char *)p)[99] != 0xab ||
+               ((unsigned char *)p)[100] || ((unsigned char *)p)[119],
+               "M_ZERO growth within a class not zeroed");
+        kfree(p);
+        p = kmalloc(16 * PAGE_SIZE, M_KERNEL);
+        memset(p, 0xcd, 16 * PAGE_SIZE);
+        bug_on(krealloc(p, 5 * PAGE_SIZE, M_KERNEL) != p ||
+               vmalloc_size(p) != 5 * PAGE_SIZE, "Big shrink moved");
+        /* The pages that were just given back are still unused. */
+        bug_on(krealloc(p, 16 * PAGE_SIZE, M_KERNEL | M_ZERO) != p ||
+               vmalloc_size(p) != 16 * PAGE_SIZE, "Big growth moved");
+        bug_on(((unsigned char *)p)[5 * PAGE_SIZE - 1] != 0xcd ||
+               ((unsigned char *)p)[5 * PAGE_SIZE] != 0,
+               "Big growth lost data");
+        kfree(p);
+
         kprintf(0, "vma_test_kmalloc passed\n");
 }
 
+/* The PFA zone that the memory at addr is in. */
+__test static pfa_zone_id_t
+vma_test_zone_of(void *addr)
+{
+        page_t *page = phys_to_page(_pa(addr));
+        return (page->flags & PG_ZONE_MASK) >> PG_ZONE_SHIFT;
+}
+
+__test static void
+vma_test_dma(void)
+{
+        mem_cache_t *cp;
+        void *p, *q;
+
+        /* DMA caches get DMA slabs whatever the allocation asks for. */
+        cp = mem_cache_create("dma!", 64, 0, SLAB_CACHE_DMA, NULL, NULL);
+        bug_on(!cp, "mem_cache_create failed");
+        p = mem_cache_alloc(cp, M_KERNEL);
+        bug_on(!p || vma_test_zone_of(p) != PFA_ZONE_DMA,
+               "DMA cache object outside the DMA zone");
+        mem_cache_free(cp, p);
+        cache_flush_mags(cp);
+        bug_on(mem_cache_destroy(cp), "Failed to destroy cache");
+
+        /* Small M_DMA kmallocs come from their own caches. */
+        p = kmalloc(100, M_KERNEL | M_DMA);
+        bug_on(!p || vma_test_zone_of(p) != PFA_ZONE_DMA,
+               "M_DMA kmalloc outside the DMA zone");
+        q = kmalloc(100, M_KERNEL);
+        bug_on(!q || vma_test_zone_of(q) == PFA_ZONE_DMA ||
+               kmalloc_cache_of(q) == kmalloc_cache_of(p),
+               "kmalloc shares a cache with M_DMA kmalloc");
+        kfree(q);
+        bug_on(krealloc(p, 120, M_KERNEL | M_DMA) != p,
+               "M_DMA krealloc moved within a class");
+        q = krealloc(p, 120, M_KERNEL);
+        bug_on(!q || q == p || vma_test_zone_of(q) == PFA_ZONE_DMA,
+               "krealloc did not leave the DMA zone");
+        kfree(q);
+
+        /* vmalloc memory would not be contiguous. */
+        bug_on(kmalloc(4 * PAGE_SIZE, M_KERNEL | M_DMA),
+               "Big M_DMA kmalloc did not fail");
+
+        kprintf(0, "vma_test_dma passed\n");
+}
+
 __test static void
 vma_test_cache_create(void)
 {
@@ -1033,23 +1652,395 @@ vma_test_cache_create(void)
 
         bug_on (mem_cache_destroy(cp), "Failed to destroy cache");
 
+        /* Off-slab objects are found through their page structs. */
+        cp = mem_cache_create("test_off!", PAGE_SIZE / 4, 0,
+                              SLAB_CACHE_NOMERGE, NULL, NULL);
+        bug_on(!cp || !(cp->flags & SLAB_CACHE_SLABOFF),
+               "mem_cache_create failed");
+        p = mem_cache_alloc(cp, 0);
+        char *q = mem_cache_alloc(cp, 0);
+        bug_on(!p || !q, "mem_cache_alloc returned NULL");
+        bug_on(slab_of(q)->cp != cp, "Wrong slab");
+        bug_on(slab_obj(cp, slab_of(q), slab_obj_index(cp, slab_of(q), q))
+               != q, "Wrong object index");
+        bug_on(slab_obj_index(cp, slab_of(q), q + 1) != cp->num,
+               "Index for a bad address");
+        mem_cache_free(cp, p);
+        mem_cache_free(cp, q);
+        bug_on(mem_cache_destroy(cp), "Failed to destroy cache");
+        bug_on(slab_of(p), "Destroyed slab still owns its pages");
+        /* The PFA zeroes freed frames through the linear map. */
+        bug_on(!pmm_getmap(proc_current()->control.pmm, (vaddr_t)p, NULL),
+               "Freed slab left the linear map");
+
         kprintf(0, "vma_test_cache_create passed\n");
 }
 
 __test static void
 vma_test_reap(void)
 {
-        slab_reap();
+        mem_cache_t *cp, *keep;
+        unsigned long i, shrinkable = 0;
+        void *head = NULL;
+
+        list_foreach_entry(&vma.cache_list, cp, cache_list)
+        {
+                bug_on(cp->nr_empty != list_size(&cp->slabs_empty),
+                       "Empty slab count out of sync");
+                if (!(cp->flags & SLAB_CACHE_NOREAP))
+                        shrinkable += cp->nr_empty << cp->pf_order;
+        }
+        bug_on(shrinkable != vma.nr_shrinkable,
+               "Shrinkable page count out of sync");
+
+        /* Reclaim run by the PFA has to get to every empty slab. */
+        cp = mem_cache_create("reap!", 4, 0, SLAB_CACHE_NOMERGE, NULL, NULL);
+        bug_on(!cp, "mem_cache_create failed");
+        mem_cache_free(cp, mem_cache_alloc(cp, 0));
+        cache_flush_mags(cp);
+        bug_on(cp->nr_empty != 1, "Freed slab is not empty");
+        bug_on(pfa_reclaim(~0UL) < (1UL << cp->pf_order),
+               "Reclaim freed too little");
+        bug_on(cp->nr_empty != 0, "Reclaim missed an empty slab");
+        bug_on(mem_cache_destroy(cp), "Failed to destroy cache");
+
+        /* NOREAP caches keep their empty slabs. */
+        keep = mem_cache_create("noreap!", 4, 0,
+                                SLAB_CACHE_NOREAP | SLAB_CACHE_NOMAG,
+                                NULL, NULL);
+        bug_on(!keep, "mem_cache_create failed");
+        mem_cache_free(keep, mem_cache_alloc(keep, 0));
+        pfa_reclaim(~0UL);
+        bug_on(keep->nr_empty != 1, "Shrinker reaped a NOREAP cache");
+        bug_on(vma.nr_shrinkable != 0, "Shrinker left empty slabs");
+
+        /* The shrinker frees about as much as it is asked to. */
+        cp = mem_cache_create("shrink!", 16, 0, SLAB_CACHE_NOMAG,
+                              NULL, NULL);
+        bug_on(!cp, "mem_cache_create failed");
+        for (i = 0; i < 3 * cp->num; i++) {
+                void **p = mem_cache_alloc(cp, 0);
+                *p = head;
+                head = p;
+        }
+        while (head) {
+                void *p = head;
+                head = *(void **)p;
+                mem_cache_free(cp, p);
+        }
+        bug_on(cp->nr_empty != 3, "Freed slabs are not empty");
+        bug_on(slab_shrink(1) != 1UL << cp->pf_order ||
+               cp->nr_empty != 2, "Shrinker freed the wrong amount");
+        bug_on(mem_cache_destroy(cp), "Failed to destroy cache");
+        bug_on(mem_cache_destroy(keep), "Failed to destroy cache");
+
         kprintf(0, "vma_test_reap passed\n");
 }
 
+__test static void
+vma_test_freelist(void)
+{
+        mem_cache_t *cp;
+        char *p, *q;
+
+        cp = mem_cache_create("freelist!", 3, 0, SLAB_CACHE_NOMAG,
+                              NULL, NULL);
+        bug_on(!cp || cp->align < sizeof(slab_free_t),
+               "mem_cache_create failed");
+
+        /* The object freed last is the first one handed out again. */
+        p = mem_cache_alloc(cp, 0);
+        q = mem_cache_alloc(cp, 0);
+        bug_on(!p || !q || p == q, "mem_cache_alloc failed");
+        mem_cache_free(cp, p);
+        mem_cache_free(cp, q);
+        bug_on(mem_cache_alloc(cp, 0) != q, "Freelist is not LIFO");
+        bug_on(mem_cache_alloc(cp, M_ZERO) != p, "Freelist is not LIFO");
+        bug_on(p[0] || p[1] || p[2], "M_ZERO object not zeroed");
+        mem_cache_free(cp, p);
+        mem_cache_free(cp, q);
+        bug_on(mem_cache_destroy(cp), "Failed to destroy cache");
+
+        kprintf(0, "vma_test_freelist passed\n");
+}
+
+__test static void
+vma_test_color(void)
+{
+        mem_cache_t *cp;
+        slab_t *sp, *prev = NULL;
+        void **objs;
+        unsigned long i, n;
+
+        cp = mem_cache_create("color!", 200, 0, SLAB_CACHE_NOMAG,
+                              NULL, NULL);
+        bug_on(!cp || cp->colors < 2, "mem_cache_create failed");
+
+        /* Successive slabs start their objects a color step apart. */
+        n = cp->colors * cp->num + 1;
+        objs = kmalloc(n * sizeof(void *), M_KERNEL);
+        bug_on(!objs, "kmalloc failed");
+        for (i = 0; i < n; i++)
+        {
+                objs[i] = mem_cache_alloc(cp, 0);
+                bug_on(!objs[i], "mem_cache_alloc failed");
+                sp = slab_of(objs[i]);
+                if (sp == prev)
+                        continue;
+                if (prev)
+                        bug_on(sp->color != (prev->color + slab_color_step(cp))
+                               % (cp->colors * slab_color_step(cp)),
+                               "Slab has the wrong color");
+                bug_on(sp->buf != (char *)slab_base(sp) + sp->color,
+                       "Slab objects not offset by the color");
+                prev = sp;
+        }
+        for (i = 0; i < n; i++)
+                mem_cache_free(cp, objs[i]);
+        kfree(objs);
+        bug_on(mem_cache_destroy(cp), "Failed to destroy cache");
+
+        /* Colors never undo the alignment that a cache promises. */
+        cp = mem_cache_create("color_align!", 256, 256,
+                              SLAB_CACHE_NOMAG | SLAB_CACHE_NOMERGE,
+                              NULL, NULL);
+        bug_on(!cp, "mem_cache_create failed");
+        n = 2 * cp->colors * cp->num;
+        objs = kmalloc(n * sizeof(void *), M_KERNEL);
+        bug_on(!objs, "kmalloc failed");
+        for (i = 0; i < n; i++)
+        {
+                objs[i] = mem_cache_alloc(cp, 0);
+                bug_on(!objs[i], "mem_cache_alloc failed");
+                bug_on((unsigned long)objs[i] & 255, "Object misaligned");
+        }
+        for (i = 0; i < n; i++)
+                mem_cache_free(cp, objs[i]);
+        kfree(objs);
+        bug_on(mem_cache_destroy(cp), "Failed to destroy cache");
+
+        kprintf(0, "vma_test_color passed\n");
+}
+
+static unsigned long vma_test_ctor_calls;
+
+__test static void
+vma_test_ctor(__attribute__((unused)) void *p,
+              __attribute__((unused)) size_t sz)
+{
+        vma_test_ctor_calls++;
+}
+
+__test static void
+vma_test_bulk(void)
+{
+        mem_cache_flags_t flags[] = { 0, SLAB_CACHE_NOMAG };
+        mem_cache_t *cp;
+        void **objs;
+        unsigned long i, j, n;
+
+        for (j = 0; j < sizeof(flags) / sizeof(flags[0]); j++)
+        {
+                cp = mem_cache_create("bulk!", 64, 0, flags[j],
+                                      vma_test_ctor, NULL);
+                bug_on(!cp, "mem_cache_create failed");
+
+                /* A batch can span several slabs. */
+                n = 2 * cp->num + 1;
+                objs = kmalloc(n * sizeof(void *), M_KERNEL);
+                bug_on(!objs, "kmalloc failed");
+                vma_test_ctor_calls = 0;
+                bug_on(mem_cache_alloc_bulk(cp, M_ZERO, n, objs),
+                       "mem_cache_alloc_bulk failed");
+                bug_on(vma_test_ctor_calls != n, "Objects not constructed");
+                bug_on(cache_num_records(cp) != n, "Objects not counted");
+                for (i = 0; i < n; i++)
+                {
+                        bug_on(slab_of(objs[i])->cp != cp, "Bad object");
+                        bug_on(((char *)objs[i])[63], "Object not zeroed");
+                        memset(objs[i], 0xff, 64);
+                }
+                bug_on(!list_empty(&cp->slabs_empty) ||
+                       list_size(&cp->slabs_full) != 2,
+                       "Slabs on the wrong lists");
+
+                mem_cache_free_bulk(cp, n, objs);
+                cache_flush_mags(cp);
+                bug_on(cp->nr_empty != 3, "Slabs not emptied");
+                kfree(objs);
+                bug_on(mem_cache_destroy(cp), "Failed to destroy cache");
+        }
+
+        kprintf(0, "vma_test_bulk passed\n");
+}
+
+__test static void
+vma_test_magazine(void)
+{
+        const unsigned long n = 4 * SLAB_MAG_ROUNDS;
+        void *objs[4 * SLAB_MAG_ROUNDS], *p;
+        mem_cache_t *cp, *other;
+        unsigned long i;
+
+        cp = mem_cache_create("mag!", 32, 0, SLAB_CACHE_NOMERGE, NULL, NULL);
+        bug_on(!cp, "mem_cache_create failed");
+
+        /* A freed object is the next one handed out. */
+        objs[0] = mem_cache_alloc(cp, 0);
+        mem_cache_free(cp, objs[0]);
+        bug_on(mem_cache_alloc(cp, 0) != objs[0], "Magazine not used");
+        mem_cache_free(cp, objs[0]);
+
+        /* Past two magazines' worth, whole magazines go to the depot
+         * and come back from it. */
+        for (i = 0; i < n; i++)
+                objs[i] = mem_cache_alloc(cp, 0);
+        for (i = 0; i < n; i++)
+                mem_cache_free(cp, objs[i]);
+        bug_on(cp->nr_mags_full < 2, "Depot has no full magazines");
+        for (i = n; i-- > 0;)
+                bug_on(mem_cache_alloc(cp, 0) != objs[i],
+                       "Magazines returned the wrong object");
+        bug_on(cp->nr_mags_full != 0, "Depot was not used");
+        for (i = 0; i < n; i++)
+                mem_cache_free(cp, objs[i]);
+
+        /* An object from another cache never makes it into one. */
+        other = mem_cache_create("mag_other!", 32, 0, SLAB_CACHE_NOMERGE,
+                                 NULL, NULL);
+        bug_on(!other, "mem_cache_create failed");
+        p = mem_cache_alloc(other, 0);
+        bug_on(!p, "mem_cache_alloc failed");
+        mem_cache_free(cp, p);
+        mem_cache_free_bulk(cp, 1, &p);
+        bug_on(cache_active(cp) != 0, "Foreign free counted");
+        objs[0] = mem_cache_alloc(cp, 0);
+        bug_on(objs[0] == p, "Foreign object in magazine");
+        mem_cache_free(cp, objs[0]);
+        mem_cache_free(other, p);
+        cache_flush_mags(other);
+        bug_on(mem_cache_destroy(other), "Failed to destroy cache");
+
+        /* Objects in magazines count as allocated until flushed. */
+        bug_on(cache_num_records(cp) != n, "Magazine objects not counted");
+        cache_flush_mags(cp);
+        bug_on(cache_num_records(cp) != 0, "Flush left objects behind");
+        bug_on(mem_cache_destroy(cp), "Failed to destroy cache");
+
+        kprintf(0, "vma_test_magazine passed\n");
+}
+
+__test static void
+vma_test_merge(void)
+{
+        mem_cache_t *a, *b, *c;
+        void *p, *q, *objs[4];
+
+        /* Caches with the same objects and slots share their slabs. No
+         * other cache is NOMAG with 40-byte objects, so a is a root. */
+        a = mem_cache_create("merge_a!", 40, 0, SLAB_CACHE_NOMAG,
+                             NULL, NULL);
+        bug_on(!a || a->merged, "Cache merged into an unrelated one");
+        b = mem_cache_create("merge_b!", 40, 0, SLAB_CACHE_NOMAG,
+                             NULL, NULL);
+        c = mem_cache_create("merge_c!", 40, 40, SLAB_CACHE_NOMAG,
+                             NULL, NULL);
+        bug_on(!b || !c || b->merged != a || c->merged != a ||
+               a->refct != 2, "Caches not merged");
+        p = mem_cache_alloc(b, M_ZERO);
+        q = mem_cache_alloc(c, 0);
+        bug_on(!p || !q || slab_of(p)->cp != a || slab_of(q)->cp != a,
+               "Merged cache has its own slabs");
+        bug_on(cache_active(b) != 1 || cache_active(c) != 1,
+               "Merged objects not counted");
+        bug_on(mem_cache_alloc_bulk(b, 0, 4, objs), "Bulk alloc failed");
+        mem_cache_free_bulk(b, 4, objs);
+        mem_cache_free(c, q);
+        bug_on(cache_active(c) != 0, "Merged frees not counted");
+
+        /* Names go before the cache they were merged into. */
+        bug_on(!mem_cache_destroy(b), "Destroyed a cache in use");
+        bug_on(!mem_cache_destroy(a), "Destroyed a cache merged into");
+        mem_cache_free(b, p);
+        bug_on(mem_cache_destroy(b) || mem_cache_destroy(c),
+               "Failed to destroy merged cache");
+        bug_on(a->refct != 0, "Merge count out of sync");
+
+        /* Objects that need a ctor are kept apart, and so are smaller
+         * objects in the same slots, other flags, and kmalloc. */
+        b = mem_cache_create("merge_b!", 40, 0, SLAB_CACHE_NOMAG,
+                             vma_test_ctor, NULL);
+        c = mem_cache_create("merge_c!", 39, 0, SLAB_CACHE_NOMAG,
+                             NULL, NULL);
+        bug_on(!b || !c || b->merged || c->merged,
+               "Incompatible cache merged");
+        bug_on(mem_cache_destroy(b) || mem_cache_destroy(c),
+               "Failed to destroy cache");
+        b = mem_cache_create("merge_b!", 40, 0, 0, NULL, NULL);
+        c = mem_cache_create("merge_c!", 32, 0, 0, NULL, NULL);
+        bug_on(!b || !c || b->merged == a || (c->merged &&
+               c->merged >= vma.kmalloc_caches &&
+               c->merged < vma.kmalloc_caches + vma.num_kmalloc_caches),
+               "Incompatible cache merged");
+        bug_on(mem_cache_destroy(b) || mem_cache_destroy(c) ||
+               mem_cache_destroy(a), "Failed to destroy cache");
+
+        kprintf(0, "vma_test_merge passed\n");
+}
+
+__test static void
+vma_test_stats(void)
+{
+        mem_cache_stat_t *stats;
+        mem_cache_t *cp;
+        void *p, *q;
+        size_t n;
+
+        cp = mem_cache_create("stats!", 24, 0,
+                              SLAB_CACHE_NOMAG | SLAB_CACHE_NOMERGE,
+                              NULL, NULL);
+        bug_on(!cp, "mem_cache_create failed");
+        p = mem_cache_alloc(cp, 0);
+        q = mem_cache_alloc(cp, 0);
+        bug_on(!p || !q, "mem_cache_alloc failed");
+        mem_cache_free(cp, p);
+
+        /* Snapshots come oldest first, so the new cache is last. */
+        n = mem_cache_stats(NULL, 0);
+        bug_on(n != vma.num_caches, "Wrong number of caches");
+        stats = kmalloc(n * sizeof(*stats), M_KERNEL);
+        bug_on(!stats, "kmalloc failed");
+        bug_on(mem_cache_stats(stats, n) != n, "Wrong number of caches");
+        bug_on(strcmp(stats[n - 1].name, "stats!"), "Caches out of order");
+        bug_on(stats[n - 1].allocs != 2 || stats[n - 1].frees != 1 ||
+               stats[n - 1].active != 1, "Objects counted wrong");
+        bug_on(stats[n - 1].grows != 1 || stats[n - 1].slabs_partial != 1 ||
+               stats[n - 1].total != cp->num ||
+               stats[n - 1].wastage != cp->wastage, "Slabs counted wrong");
+        kfree(stats);
+
+        mem_cache_free(cp, q);
+        bug_on(cache_shrink(cp, ~0UL) == 0 || cp->nr_reaps != 1,
+               "Reaped slab not counted");
+        bug_on(mem_cache_destroy(cp), "Failed to destroy cache");
+
+        kprintf(0, "vma_test_stats passed\n");
+}
+
 __test void
 vma_test(void)
 {
 #ifdef CONF_DEBUG
         vma_test_kmalloc();
+        vma_test_dma();
         vma_test_cache_create();
         vma_test_reap();
+        vma_test_freelist();
+        vma_test_color();
+        vma_test_magazine();
+        vma_test_bulk();
+        vma_test_merge();
+        vma_test_stats();
 #endif
 }
 
@@ -0,0 +1,319 @@
+/*
+Copyright (c) 2016, James Sullivan <sullivan.james.f@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote
+      products derived from this software without specific prior
+      written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER>
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * mm/vmalloc.c
+ *
+ * Virtually contiguous kernel allocations. Each area is backed by
+ * order-0 pages, which need not be physically contiguous, mapped into
+ * the vmalloc range at KERN_VMAP_BASE. An unmapped guard page follows
+ * every area. The pages are only ever reached through that mapping, so
+ * they are taken from high memory. The page struct of an area's first
+ * page points back at the area, which is how an address is looked up.
+ */
+
+#include <machine/cpu.h>
+#include <mm/mempool.h>
+#include <mm/paging.h>
+#include <mm/pfa.h>
+#include <mm/pmm.h>
+#include <mm/vma.h>
+#include <sys/config.h>
+#include <sys/kprintf.h>
+#include <sys/panic.h>
+#include <sys/proc.h>
+#include <sys/size.h>
+#include <sys/string.h>
+#include <util/list.h>
+
+typedef struct vm_area {
+        vaddr_t          start;
+        unsigned long    npages;        /* Mapped, not counting the guard */
+        struct list_head list;
+} vm_area_t;
+
+/* Areas in use, sorted by address. */
+static LIST_HEAD(vmap_areas);
+static mem_cache_t *vm_area_cache;
+/* Enough areas for big kmallocs to keep working while memory is short,
+ * as long as there are pages to map. */
+static mempool_t *vm_area_pool;
+#define VM_AREA_RESERVE 8
+static unsigned long vmap_nr_pages;
+
+#define VMAP_END (KERN_VMAP_BASE + KERN_VMAP_SZ)
+
+static inline vaddr_t
+vm_area_end(vm_area_t *ap)
+{
+        return ap->start + (ap->npages << PAGE_SHIFT);
+}
+
+/* The first address past the guard page of ap, or past the end of the
+ * range if ap is the last area. */
+static inline vaddr_t
+vm_area_limit(vm_area_t *ap)
+{
+        if (ap->list.next == &vmap_areas)
+                return VMAP_END;
+        return list_next_entry(ap, list)->start;
+}
+
+/* The page struct of the page mapped at va, or NULL. */
+static page_t *
+vmap_page(vaddr_t va)
+{
+        paddr_t phys;
+        if (!pmm_getmap(proc_current()->control.pmm, va, &phys))
+                return NULL;
+        return phys_to_page(phys);
+}
+
+/* The area that starts at addr, or NULL. */
+static vm_area_t *
+vm_area_find(const void *addr)
+{
+        page_t *page;
+
+        if (!is_vmalloc_addr(addr) || ((vaddr_t)addr & (PAGE_SIZE - 1)))
+                return NULL;
+        page = vmap_page((vaddr_t)addr);
+        if (!page || !page->vm_area || page->vm_area->start != (vaddr_t)addr)
+                return NULL;
+        return page->vm_area;
+}
+
+/* Find the lowest gap that fits 'npages' pages and a guard page. Returns
+ * its address, and the list entry that an area there goes before, or
+ * 0 if the range is full. */
+static vaddr_t
+vmap_find_gap(unsigned long npages, struct list_head **pos)
+{
+        unsigned long span = (npages + 1) << PAGE_SHIFT;
+        vaddr_t start = KERN_VMAP_BASE;
+        vm_area_t *ap;
+
+        list_foreach_entry(&vmap_areas, ap, list)
+        {
+                if (ap->start - start >= span) {
+                        *pos = &ap->list;
+                        return start;
+                }
+                start = vm_area_end(ap) + PAGE_SIZE;
+        }
+        if (VMAP_END - start < span)
+                return 0;
+        *pos = &vmap_areas;
+        return start;
+}
+
+/* Unmap the 'npages' pages from 'va' and give them back to the PFA. */
+static void
+vmap_unmap(vaddr_t va, unsigned long npages)
+{
+        pmm_t *pmm = proc_current()->control.pmm;
+        paddr_t phys;
+
+        while (npages-- > 0)
+        {
+                pmm_unmap(pmm, va, &phys);
+                pfa_free(phys_to_page(phys));
+                vmap_nr_pages--;
+                va += PAGE_SIZE;
+        }
+}
+
+/* Back the 'npages' pages from 'va' with fresh pages. Either all of
+ * them are mapped and 0 is returned, or none are and 1 is returned. */
+static int
+vmap_map(vaddr_t va, unsigned long npages, mflags_t flags)
+{
+        pmm_t *pmm = proc_current()->control.pmm;
+        unsigned long i;
+
+        for (i = 0; i < npages; i++)
+        {
+                vaddr_t v = va + (i << PAGE_SHIFT);
+                /* M_HIGH only picks the zone; in pmm_map it would make
+                 * the page a user page. */
+                page_t *page = pfa_alloc_colored(flags | M_HIGH, 0, v);
+                if (!page)
+                        goto fail;
+                if (pmm_map(pmm, v, page_to_phys(page), flags, PFLAGS_RW)) {
+                        pfa_free(page);
+                        goto fail;
+                }
+                vmap_nr_pages++;
+        }
+        return 0;
+fail:
+        vmap_unmap(va, i);
+        return 1;
+}
+
+void *
+vmalloc(unsigned long size, mflags_t flags)
+{
+        unsigned long npages = PFN_UP(size);
+        struct list_head *pos;
+        vm_area_t *ap;
+
+        if (BAD_MFLAGS_FOR_VMM(flags) || size == 0)
+                return NULL;
+
+        ap = mempool_alloc(vm_area_pool, flags & ~M_ZERO);
+        if (!ap)
+                return NULL;
+        ap->start = vmap_find_gap(npages, &pos);
+        ap->npages = npages;
+        if (!ap->start || vmap_map(ap->start, npages, flags)) {
+                mempool_free(vm_area_pool, ap);
+                return NULL;
+        }
+        list_add_tail(pos, &ap->list);
+        vmap_page(ap->start)->vm_area = ap;
+        return (void *)ap->start;
+}
+
+void
+vfree(void *addr)
+{
+        vm_area_t *ap;
+
+        if (!addr)
+                return;
+        ap = vm_area_find(addr);
+        bug_on(!ap, "vfree of an address that is not a vmalloc area");
+        vmap_page(ap->start)->vm_area = NULL;
+        vmap_unmap(ap->start, ap->npages);
+        list_del(&ap->list);
+        mempool_free(vm_area_pool, ap);
+}
+
+bool
+vresize(void *addr, unsigned long size, mflags_t flags)
+{
+        unsigned long npages = PFN_UP(size);
+        vm_area_t *ap;
+
+        if (BAD_MFLAGS_FOR_VMM(flags) || size == 0)
+                return false;
+        ap = vm_area_find(addr);
+        if (!ap)
+                return false;
+
+        if (npages < ap->npages) {
+                vmap_unmap(ap->start + (npages << PAGE_SHIFT),
+                           ap->npages - npages);
+        } else if (npages > ap->npages) {
+                /* Keep the guard page clear of the next area. */
+                if (vm_area_limit(ap) - ap->start
+                                < (npages + 1) << PAGE_SHIFT ||
+                    vmap_map(vm_area_end(ap), npages - ap->npages, flags))
+                        return false;
+        }
+        ap->npages = npages;
+        return true;
+}
+
+unsigned long
+vmalloc_size(const void *addr)
+{
+        vm_area_t *ap = vm_area_find(addr);
+        return ap ? ap->npages << PAGE_SHIFT : 0;
+}
+
+void
+vmalloc_init(void)
+{
+        vm_area_cache = mem_cache_create("vm_area_cache", sizeof(vm_area_t),
+                                         sizeof(vm_area_t), 0, NULL, NULL);
+        bug_on(!vm_area_cache, "Failed to allocate vm_area cache");
+        vm_area_pool = mempool_create(vm_area_cache, VM_AREA_RESERVE);
+        bug_on(!vm_area_pool, "Failed to allocate vm_area pool");
+}
+
+void
+vmalloc_report(void)
+{
+        kprintf(0, "vmalloc: %d KiB in %d areas\n",
+                (vmap_nr_pages << PAGE_SHIFT) / KB, list_size(&vmap_areas));
+}
+
+__test void
+vmalloc_test(void)
+{
+#ifdef CONF_DEBUG
+        unsigned long pages = vmap_nr_pages;
+        unsigned long i;
+        unsigned char *a, *b;
+
+        a = vmalloc(3 * PAGE_SIZE + 1, M_KERNEL);
+        bug_on(!a || !is_vmalloc_addr(a), "vmalloc failed");
+        bug_on(vmalloc_size(a) != 4 * PAGE_SIZE, "vmalloc size not rounded");
+        bug_on(vmalloc_size(a + PAGE_SIZE), "Area found inside another");
+        for (i = 0; i < 4 * PAGE_SIZE; i++)
+                a[i] = (unsigned char)i;
+
+        /* Areas never overlap each other's guard pages. */
+        b = vmalloc(PAGE_SIZE, M_KERNEL | M_ZERO);
+        bug_on(!b, "vmalloc failed");
+        bug_on(b + 2 * PAGE_SIZE > a && b < a + 5 * PAGE_SIZE,
+               "vmalloc areas overlap");
+        for (i = 0; i < PAGE_SIZE; i++)
+                bug_on(b[i], "M_ZERO area not zeroed");
+
+        /* Growth stops at the guard page before the next area. */
+        if (b == a + 5 * PAGE_SIZE) {
+                bug_on(vresize(a, 5 * PAGE_SIZE, M_KERNEL),
+                       "vresize ran into the next area");
+                vfree(b);
+                b = NULL;
+                bug_on(!vresize(a, 5 * PAGE_SIZE, M_KERNEL),
+                       "vresize failed with room to grow");
+                a[5 * PAGE_SIZE - 1] = 0xab;
+        }
+        bug_on(!vresize(a, PAGE_SIZE, M_KERNEL) ||
+               vmalloc_size(a) != PAGE_SIZE, "vresize did not shrink");
+        for (i = 0; i < PAGE_SIZE; i++)
+                bug_on(a[i] != (unsigned char)i, "vresize lost data");
+
+        vfree(a);
+        vfree(b);
+        bug_on(vmalloc_size(a), "Freed area still mapped");
+        bug_on(vmap_nr_pages != pages, "vfree leaked pages");
+
+        /* The range can be used up, but not overrun. */
+        bug_on(vmalloc(KERN_VMAP_SZ, M_KERNEL), "vmalloc overran its range");
+
+        kprintf(0, "vmalloc_test passed\n");
+#endif
+}
@@ -31,6 +31,7 @@ THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <mm/vmmap.h>
 
+#include <mm/mempool.h>
 #include <mm/vma.h>
 #include <mm/vmobject.h>
 #include <mm/paging.h>
@@ -45,6 +46,10 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #include <util/cmp.h>
 
 static mem_cache_t *vmmap_area_cache;
+/* Areas set aside so that a map can still be changed when memory is
+ * short, e.g. on fork or in fault handling. */
+static mempool_t *vmmap_area_pool;
+#define VMMAP_AREA_RESERVE 16
 
 // Creates a new mapping. 'object' may be null.
 static vmmap_area_t *
@@ -590,8 +595,7 @@ static vmmap_area_t *
 vmmap_area_create(vaddr_t start, unsigned long size,
                   vmobject_t *object, unsigned long offset)
 {
-        vmmap_area_t *area = mem_cache_alloc(vmmap_area_cache,
-                                             M_KERNEL);
+        vmmap_area_t *area = mempool_alloc(vmmap_area_pool, M_KERNEL);
         if (!area)
                 return area;
 
@@ -608,7 +612,7 @@ vmmap_area_create(vaddr_t start, unsigned long size,
 static void
 vmmap_area_destroy(vmmap_area_t *area)
 {
-        mem_cache_free(vmmap_area_cache, area);
+        mempool_free(vmmap_area_pool, area);
 }
 
 static void
@@ -1079,6 +1083,8 @@ vmmap_global_init(void)
                                  vmmap_area_ctor, vmmap_area_dtor);
 
         bug_on(!vmmap_area_cache, "Failed to allocate vmmap area cache");
+        vmmap_area_pool = mempool_create(vmmap_area_cache, VMMAP_AREA_RESERVE);
+        bug_on(!vmmap_area_pool, "Failed to allocate vmmap area pool");
         DO_TEST(vmmap_test);
         return 0;
 }
@@ -78,6 +78,26 @@ vmobject_add_page(vmobject_t *object, page_t *pg)
         object->page = pg;
 }
 
+int
+vmobject_replace_page(vmobject_t *object, page_t *old, page_t *pg)
+{
+        page_t **pp;
+
+        bug_on(!object, "NULL object");
+        bug_on(!old || !pg, "NULL page");
+        bug_on(pg->next, "page is already owned");
+        for (pp = &object->page; *pp; pp = &(*pp)->next)
+        {
+                if (*pp != old)
+                        continue;
+                pg->next = old->next;
+                *pp = pg;
+                old->next = NULL;
+                return 0;
+        }
+        return 1;
+}
+
 static int
 vmobject_init(void)
 {
@@ -29,8 +29,11 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
 THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <mm/pfa.h>
 #include <mm/pmm.h>
 #include <mm/vma.h>
+#include <mm/vmmap.h>
+#include <mm/vmobject.h>
 #include <sched/scheduler.h>
 #include <sys/kprintf.h>
 #include <sys/panic.h>
@@ -108,8 +111,7 @@ make_child(proc_t *par, proc_t *p, fork_req_t req)
                 return 1;
         }
         if (req & FORK_FLAGS_COPYUSER) {
-                if (pmm_copy_user(p->control.pmm,
-                                  (const pmm_t *)par->control.pmm)) {
+                if (pmm_copy_user(p->control.pmm, par->control.pmm)) {
                         kprintf(0, "Failed to copy user page tables\n");
                         return 1;
                 }
@@ -198,6 +200,41 @@ proc_system_init_alloc(void)
         panic_on(!proc_alloc_cache, "Failed to create pcb_cache");
 }
 
+/* Moves a user page for compaction in the PFA (see pfa_set_migrate).
+ * A frame is mapped at page->vaddr in every process that has it, as
+ * forks keep the address, so that is where each address space is
+ * looked at. The object that owned the page, in the processes that have
+ * one for it, owns the new page from then on. */
+static bool
+proc_migrate(page_t *from, page_t *to, unsigned int order)
+{
+        vaddr_t va = from->vaddr;
+        bool moved = false;
+        pid_t pid;
+
+        /* User pages are the only movable ones, and come singly. */
+        if (order != 0 || !va || va >= KERN_BASE)
+                return false;
+        if (pmm_copy_page(to, from))
+                return false;
+        for (pid = 0; pid <= pid_max; pid++)
+        {
+                proc_t *p = proc_table[pid];
+                vmmap_area_t *area;
+                if (!p || !pmm_migrate(p->control.pmm, va, from, to))
+                        continue;
+                moved = true;
+                area = vmmap_find(&p->state.vmmap, va);
+                if (area)
+                        vmobject_replace_page(area->object, from, to);
+        }
+        if (!moved)
+                return false;
+        to->vaddr = va;
+        to->shared = from->shared;
+        return true;
+}
+
 void
 proc_system_early_init(void)
 {
@@ -210,6 +247,9 @@ proc_system_init(void)
         proc_system_init_alloc();
         proc_system_init_table();
         proc_system_init_initproc();
+        /* User pages can be moved once there are processes to find
+         * them in. */
+        pfa_set_migrate(proc_migrate);
 }
 
 
@@ -0,0 +1,59 @@
+/*
+Copyright (c) 2016, James Sullivan <sullivan.james.f@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote
+      products derived from this software without specific prior
+      written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER>
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <mm/vma.h>
+#include <mm/vmmap.h>
+#include <sys/errno.h>
+#include <sys/proc.h>
+#include <sys/syscalls.h>
+
+/* Copies the counters of up to n memory caches into buf, which has to
+ * lie within one writable mapped area of the caller. Returns the number of
+ * caches there are, so a caller can size buf with n = 0 first. */
+SYSCALL(slabinfo, struct mem_cache_stat *buf, size_t n)
+{
+        proc_t *me = proc_current();
+        vaddr_t start = (vaddr_t)buf;
+        vaddr_t end = start + n * sizeof(*buf);
+        vmmap_area_t *area;
+
+        if (n > 0) {
+                area = vmmap_find(&me->state.vmmap, start);
+                if (n > ~0UL / sizeof(*buf) || end < start || !area ||
+                    end > area->start + area->size ||
+                    !(area->object->pflags & PFLAGS_WRITE)) {
+                        *errno = EFAULT;
+                        return -1;
+                }
+        }
+        *errno = 0;
+        return mem_cache_stats(buf, n);
+}
@@ -0,0 +1,67 @@
+/*
+Copyright (c) 2016, James Sullivan <sullivan.james.f@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote
+      products derived from this software without specific prior
+      written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER>
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+/*
+ * test/mm/host.h - Services provided by the host C library to the
+ * allocator harness.
+ *
+ * The kernel sources are built freestanding against the kernel
+ * headers, so anything that needs the host's libc is kept behind this
+ * small interface (see host_libc.c).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Allocate a page-aligned, zeroed arena of 'sz' bytes to stand in for
+ * physical memory, at the start of 'span' bytes of reserved address
+ * space. */
+void *host_arena(size_t sz, size_t span);
+
+/* Map the arena page at offset 'off' at 'va' as well, which must be in
+ * the reserved span past the arena; or take such a mapping away. */
+void host_map_page(void *va, size_t off);
+void host_unmap_page(void *va);
+
+/* Monotonic time in nanoseconds. */
+uint64_t host_nsec(void);
+
+/* Deterministic pseudo-random numbers for reproducible traces. */
+void host_srand(uint32_t seed);
+uint32_t host_rand(void);
+
+/* Terminate the harness with the given status. */
+void host_exit(int status) __attribute__((noreturn));
+
+#endif
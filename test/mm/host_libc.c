@@ -0,0 +1,188 @@
+/*
+Copyright (c) 2016, James Sullivan <sullivan.james.f@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote
+      products derived from this software without specific prior
+      written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER>
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * test/mm/host_libc.c - Host-side services for the allocator harness.
+ *
+ * This is the only file in the harness compiled against the host C
+ * library. It provides the handful of kernel library routines that the
+ * allocator sources link against (kprintf, banner, ...) and the
+ * helpers declared in host.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "host.h"
+
+uintptr_t host_kern_base;
+
+void
+kprintf(int pri, const char *fmt, ...)
+{
+        va_list args;
+        (void)pri;
+        va_start(args, fmt);
+        vprintf(fmt, args);
+        va_end(args);
+}
+
+int
+banner(char *dest, size_t dsz, size_t width, char border,
+       const char *fmt, ...)
+{
+        char title[80];
+        size_t len, left, i;
+        va_list args;
+
+        va_start(args, fmt);
+        vsnprintf(title, sizeof(title), fmt, args);
+        va_end(args);
+
+        len = strlen(title);
+        if (width >= dsz)
+                width = dsz - 1;
+        left = width > len ? (width - len) / 2 : 0;
+        for (i = 0; i < width; i++)
+                dest[i] = border;
+        dest[width] = '\0';
+        memcpy(dest + left, title, len > width ? width : len);
+        return (int)width;
+}
+
+char *
+strlcpy(char *dst, const char *from, size_t n)
+{
+        size_t len = strlen(from);
+        if (n) {
+                size_t c = len < n - 1 ? len : n - 1;
+                memcpy(dst, from, c);
+                dst[c] = '\0';
+        }
+        return dst;
+}
+
+/* bug() and panic() end in an infinite loop after printing a
+ * backtrace; on the host we would rather fail the run. */
+void
+backtrace(unsigned int max)
+{
+        (void)max;
+        fflush(stdout);
+        abort();
+}
+
+/* The arena lives in a memory file, so that its pages can be mapped a
+ * second time elsewhere, as the kernel's vmalloc does. */
+static int arena_fd = -1;
+
+static void
+host_die(const char *what)
+{
+        perror(what);
+        exit(1);
+}
+
+void *
+host_arena(size_t sz, size_t span)
+{
+        void *p;
+
+        arena_fd = memfd_create("arena", 0);
+        if (arena_fd < 0 || ftruncate(arena_fd, (off_t)sz))
+                host_die("arena");
+        p = mmap(NULL, span, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED ||
+            mmap(p, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 arena_fd, 0) == MAP_FAILED)
+                host_die("arena");
+        return p;
+}
+
+void
+host_map_page(void *va, size_t off)
+{
+        if (mmap(va, 4096, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 arena_fd, (off_t)off) == MAP_FAILED)
+                host_die("host_map_page");
+}
+
+void
+host_unmap_page(void *va)
+{
+        if (mmap(va, 4096, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                 -1, 0) == MAP_FAILED)
+                host_die("host_unmap_page");
+}
+
+uint64_t
+host_nsec(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t rand_state = 1;
+
+void
+host_srand(uint32_t seed)
+{
+        rand_state = seed ? seed : 1;
+}
+
+uint32_t
+host_rand(void)
+{
+        /* xorshift32 */
+        uint32_t x = rand_state;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return rand_state = x;
+}
+
+void
+host_exit(int status)
+{
+        fflush(stdout);
+        exit(status);
+}
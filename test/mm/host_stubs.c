@@ -0,0 +1,181 @@
+/*
+Copyright (c) 2016, James Sullivan <sullivan.james.f@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote
+      products derived from this software without specific prior
+      written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER>
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * test/mm/host_stubs.c - Mocked machine layer for the allocator
+ * harness.
+ *
+ * Physical memory is a single host arena whose address doubles as
+ * KERN_BASE, so the kernel's direct map (_va/_pa) works unchanged.
+ * The pmm routines only record the page's mapping, since every
+ * "physical" page is already addressable, except in the vmalloc range,
+ * where arena pages are really mapped a second time.
+ */
+
+#include <machine/cpu.h>
+#include <mm/memlimits.h>
+#include <mm/pfa.h>
+#include <mm/pmm.h>
+#include <mm/vma.h>
+#include <sys/proc.h>
+#include <sys/string.h>
+#include <sys/timer.h>
+
+#include "host.h"
+#include "host_stubs.h"
+
+extern uintptr_t host_kern_base;
+
+pmm_t init_pmm;
+static memlimits_t host_limits;
+static proc_t host_proc;
+static cpu_t host_cpu;
+
+/* What each page of the vmalloc range is mapped to. */
+static paddr_t vmap_pa[KERN_VMAP_SZ / PAGE_SIZE];
+
+cpu_t *
+arch_cpu_current(void)
+{
+        return &host_cpu;
+}
+
+int
+pmm_map(pmm_t *p, vaddr_t va, paddr_t pa, mflags_t flags, pflags_t pflags)
+{
+        page_t *page;
+
+        (void)p;
+        (void)pflags;
+        if (is_vmalloc_addr((void *)va)) {
+                host_map_page((void *)va, pa);
+                vmap_pa[(va - KERN_VMAP_BASE) >> PAGE_SHIFT] = pa;
+        }
+        page = phys_to_page(pa);
+        if ((flags & M_ZERO) && !(page && (page->flags & PG_ZERO)))
+                bzero((void *)va, PAGE_SIZE);
+        if (page) {
+                page->flags &= ~PG_ZERO;
+                page->vaddr = va;
+        }
+        return 0;
+}
+
+void
+pmm_unmap(pmm_t *p, vaddr_t va, paddr_t *ret_pa)
+{
+        paddr_t pa = _pa(va);
+        page_t *page;
+
+        (void)p;
+        if (is_vmalloc_addr((void *)va)) {
+                pa = vmap_pa[(va - KERN_VMAP_BASE) >> PAGE_SHIFT];
+                vmap_pa[(va - KERN_VMAP_BASE) >> PAGE_SHIFT] = 0;
+                host_unmap_page((void *)va);
+        }
+        page = phys_to_page(pa);
+        if (page)
+                page->vaddr = 0;
+        if (ret_pa)
+                *ret_pa = pa;
+}
+
+bool
+pmm_getmap(pmm_t *p, vaddr_t va, paddr_t *ret_pa)
+{
+        paddr_t pa = _pa(va);
+
+        (void)p;
+        if (is_vmalloc_addr((void *)va))
+                pa = vmap_pa[(va - KERN_VMAP_BASE) >> PAGE_SHIFT];
+        if (ret_pa)
+                *ret_pa = pa;
+        return pa != 0;
+}
+
+/* There is no timer interrupt, so the zero pools are only filled when
+ * asked to. */
+void
+timer_init(timer_t *timer, timer_fn_t callback)
+{
+        timer->callback = callback;
+}
+
+void
+timer_start(timer_t *timer, unsigned long us_until)
+{
+        (void)timer;
+        (void)us_until;
+}
+
+memlimits_t *
+host_mm_init(size_t npages)
+{
+        memlimits_t *lim = &host_limits;
+        size_t dma_end = 256;
+        size_t low_start = dma_end + 256; /* Pretend kernel image */
+
+        host_kern_base = (uintptr_t)host_arena(npages * PAGE_SIZE,
+                        HOST_VMAP_OFFS + KERN_VMAP_SZ);
+
+        lim->dma_pfn     = 1;
+        lim->dma_pfn_end = dma_end;
+        lim->low_pfn     = low_start;
+        lim->high_pfn    = low_start + ((npages - low_start) >> 2);
+        lim->max_pfn     = npages;
+
+        /* Lay the arena out like a PC: a hole for the legacy video
+         * memory below the kernel, and one in high memory. */
+        lim->nr_regions = 3;
+        lim->regions[0].start_pfn = 1;
+        lim->regions[0].end_pfn   = 160;
+        lim->regions[1].start_pfn = 192;
+        lim->regions[1].end_pfn   = (npages * 3) / 4;
+        lim->regions[2].start_pfn = (npages * 3) / 4 + 4096 + 17;
+        lim->regions[2].end_pfn   = npages;
+
+        init_pmm.lim = lim;
+        pfa_init(lim);
+
+        host_proc.control.pmm = &init_pmm;
+        host_cpu.self = &host_cpu;
+        host_cpu.proc = &host_proc;
+        host_cpu.id = 0;
+        host_cpu._percpu = (void *)PERCPU_START;
+        pfa_init_late();
+
+        vma_init();
+
+        /* Normally sysinit steps. */
+        pfa_init_deferred();
+        pfa_init_background();
+        return lim;
+}
@@ -0,0 +1,59 @@
+/*
+Copyright (c) 2016, James Sullivan <sullivan.james.f@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote
+      products derived from this software without specific prior
+      written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER>
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _MACHINE_PARAMS_H_
+#define _MACHINE_PARAMS_H_
+
+/*
+ * machine/params.h - Host build parameters
+ *
+ * Shadows the x86_64 params for the userspace allocator harness. The
+ * kernel's direct map is emulated by a single host arena, so KERN_BASE
+ * is the arena's address rather than a constant.
+ */
+
+#include <stdint.h>
+
+#define WORD_SIZE 64
+
+#define STACK_SZ 65536
+
+extern uintptr_t host_kern_base;
+
+#define KERN_OFFS           0x200000ULL
+#define KERN_BASE           ((uint64_t)host_kern_base)
+#define KERN_TOP            0xffffffffffffffffULL
+#define KERN_SZ             (KERN_TOP - KERN_BASE)
+#define HOST_VMAP_OFFS      0x60000000ULL
+#define KERN_VMAP_BASE      (KERN_BASE + HOST_VMAP_OFFS)
+#define KERN_VMAP_SZ        0x04000000ULL
+
+#endif
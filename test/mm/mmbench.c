@@ -0,0 +1,524 @@
+/*
+Copyright (c) 2016, James Sullivan <sullivan.james.f@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote
+      products derived from this software without specific prior
+      written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER>
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * test/mm/mmbench.c - Userspace benchmarks for the page frame and slab
+ * allocators.
+ *
+ * Runs the in-kernel self tests, then a fixed set of allocation traces
+ * against kernel/mm/pfa.c and kernel/mm/vma_slab.c, reporting
+ * throughput and fragmentation for each.
+ */
+
+#include <mm/mempool.h>
+#include <mm/pfa.h>
+#include <mm/pmm.h>
+#include <mm/vma.h>
+#include <sys/kprintf.h>
+#include <sys/panic.h>
+#include <sys/string.h>
+
+#include "host.h"
+#include "host_stubs.h"
+
+#define BENCH_PAGES     (64UL * 1024)   /* 256MiB of "physical" memory */
+#define BENCH_SLOTS     4096
+
+static void *slots[BENCH_SLOTS];
+static unsigned int slot_order[BENCH_SLOTS];
+
+static void
+report(const char *name, unsigned long ops, uint64_t ns)
+{
+        unsigned long long rate = ns ? (ops * 1000000000ULL) / ns : 0;
+        kprintf(0, "%-24s %10lu ops %8llu us %12llu ops/sec\n", name, ops,
+                (unsigned long long)(ns / 1000), rate);
+}
+
+/* Percentage of free high memory that is not part of a block of at
+ * least 'order'. 0 means no fragmentation for that order. */
+static unsigned long
+frag_index(unsigned int order)
+{
+        unsigned long total = 0, usable = 0;
+        unsigned int i;
+        for (i = 0; i < PFA_MAX_PAGE_ORDER; i++)
+        {
+                unsigned long n = pfa.zones[PFA_ZONE_HIGH].blocks[i].nr_free;
+                total += n << i;
+                if (i >= order)
+                        usable += n << i;
+        }
+        return total ? 100 - (usable * 100) / total : 0;
+}
+
+static void
+bench_pfa_single(void)
+{
+        const unsigned long iters = 1000000;
+        unsigned long i;
+        uint64_t t = host_nsec();
+        for (i = 0; i < iters; i++)
+        {
+                page_t *p = pfa_alloc(M_KERNEL);
+                pfa_free(p);
+        }
+        report("pfa alloc/free", iters * 2, host_nsec() - t);
+}
+
+static void
+bench_pfa_batch(void)
+{
+        const unsigned long rounds = 200;
+        unsigned long r, i;
+        uint64_t t = host_nsec();
+        for (r = 0; r < rounds; r++)
+        {
+                for (i = 0; i < BENCH_SLOTS; i++)
+                        slots[i] = pfa_alloc(M_HIGH);
+                for (i = 0; i < BENCH_SLOTS; i++)
+                {
+                        unsigned long j = host_rand() % BENCH_SLOTS;
+                        void *tmp = slots[i];
+                        slots[i] = slots[j];
+                        slots[j] = tmp;
+                }
+                for (i = 0; i < BENCH_SLOTS; i++)
+                        pfa_free(slots[i]);
+        }
+        report("pfa batch (random free)", rounds * BENCH_SLOTS * 2,
+               host_nsec() - t);
+}
+
+static void
+bench_pfa_churn(void)
+{
+        const unsigned long iters = 500000;
+        unsigned long i, ops = 0;
+        uint64_t t;
+
+        bzero(slots, sizeof(slots));
+        t = host_nsec();
+        for (i = 0; i < iters; i++)
+        {
+                unsigned long s = host_rand() % BENCH_SLOTS;
+                if (slots[s]) {
+                        pfa_free_pages(slots[s], slot_order[s]);
+                        slots[s] = NULL;
+                } else {
+                        slot_order[s] = host_rand() % 6;
+                        slots[s] = pfa_alloc_pages(M_HIGH, slot_order[s]);
+                }
+                ops++;
+        }
+        t = host_nsec() - t;
+        report("pfa multi-order churn", ops, t);
+        kprintf(0, "%-24s order-5 %lu%% order-9 %lu%%\n", "  fragmentation",
+                frag_index(5), frag_index(9));
+        for (i = 0; i < BENCH_SLOTS; i++)
+        {
+                if (slots[i])
+                        pfa_free_pages(slots[i], slot_order[i]);
+                slots[i] = NULL;
+        }
+}
+
+static void
+bench_pfa_fragment(void)
+{
+        unsigned long i;
+
+        for (i = 0; i < BENCH_SLOTS; i++)
+                slots[i] = pfa_alloc(M_HIGH);
+        for (i = 0; i < BENCH_SLOTS; i += 2)
+        {
+                pfa_free(slots[i]);
+                slots[i] = NULL;
+        }
+        kprintf(0, "%-24s order-5 %lu%% order-9 %lu%%\n",
+                "pfa checkerboard frag", frag_index(5), frag_index(9));
+        for (i = 1; i < BENCH_SLOTS; i += 2)
+        {
+                pfa_free(slots[i]);
+                slots[i] = NULL;
+        }
+        kprintf(0, "%-24s order-5 %lu%% order-9 %lu%%\n",
+                "  after release", frag_index(5), frag_index(9));
+}
+
+/* Kernel allocations well past the boot-time size of low memory, which
+ * can only be served by borrowing blocks from high memory. */
+static void
+bench_pfa_zone_pressure(void)
+{
+        const unsigned int order = 9;
+        unsigned long n = (2 * lowmem_pages_avail(pfa.limits)) >> order;
+        pfa_zone_t *lo = &pfa.zones[PFA_ZONE_LOW];
+        unsigned long borrowed = lo->nr_borrowed;
+        unsigned long i, got = 0;
+        uint64_t t;
+
+        if (n > BENCH_SLOTS)
+                n = BENCH_SLOTS;
+        t = host_nsec();
+        for (i = 0; i < n; i++)
+        {
+                slots[i] = pfa_alloc_pages(M_KERNEL, order);
+                if (slots[i])
+                        got++;
+        }
+        t = host_nsec() - t;
+        report("pfa low zone pressure", n, t);
+        kprintf(0, "%-24s %lu of %lu served, %lu blocks borrowed\n",
+                "  rebalancing", got, n, lo->nr_borrowed - borrowed);
+        for (i = 0; i < n; i++)
+        {
+                if (slots[i])
+                        pfa_free_pages(slots[i], order);
+                slots[i] = NULL;
+        }
+}
+
+static page_t *movable[BENCH_PAGES];
+
+/* Stands in for the VM system: moves a page and fixes up the one
+ * reference to it, whose index is kept in the page's vaddr. */
+static bool
+bench_migrate(page_t *from, page_t *to, unsigned int order)
+{
+        memcpy((void *)_va(page_to_phys(to)),
+               (void *)_va(page_to_phys(from)), PAGE_SIZE << order);
+        to->vaddr = from->vaddr;
+        movable[from->vaddr] = to;
+        return true;
+}
+
+/* Fill high memory with movable pages, free every other one, and then
+ * ask for big blocks, which compaction has to make room for. */
+static void
+bench_pfa_compact(void)
+{
+        const unsigned int order = 9;
+        const unsigned long contig = 3UL << (PFA_MAX_PAGE_ORDER - 1);
+        unsigned long i, n, got = 0;
+        unsigned long migrated = pfa.nr_migrated;
+        page_t *big[16];
+        page_t *run;
+        uint64_t t;
+
+        pfa_set_migrate(bench_migrate);
+        for (n = 0; n < BENCH_PAGES; n++)
+        {
+                movable[n] = pfa_alloc(M_HIGH | M_MOVABLE);
+                if (!movable[n])
+                        break;
+                movable[n]->vaddr = n;
+        }
+        for (i = 0; i < n; i += 2)
+        {
+                pfa_free(movable[i]);
+                movable[i] = NULL;
+        }
+        kprintf(0, "%-24s order-5 %lu%% order-9 %lu%%\n",
+                "pfa movable checkerboard", frag_index(5), frag_index(9));
+
+        t = host_nsec();
+        for (i = 0; i < 16; i++)
+        {
+                big[i] = pfa_alloc_pages(M_HIGH | M_WAIT, order);
+                if (big[i])
+                        got++;
+        }
+        run = pfa_alloc_contig(M_HIGH | M_WAIT, contig);
+        t = host_nsec() - t;
+        report("pfa compaction", 17, t);
+        kprintf(0, "%-24s %lu of 16 order-9 blocks, contig %s, "
+                "%lu blocks migrated\n", "  compacted", got,
+                run ? "ok" : "failed", pfa.nr_migrated - migrated);
+
+        pfa_free_contig(run, contig);
+        for (i = 0; i < 16; i++)
+                pfa_free_pages(big[i], order);
+        for (i = 1; i < n; i += 2)
+                pfa_free(movable[i]);
+        pfa_set_migrate(NULL);
+}
+
+/* Map M_ZERO pages, first out of the zero pool and then, with the pool
+ * used up, zeroing each one on the spot. */
+static void
+bench_pfa_zero(void)
+{
+        const char *names[2] = { "pfa M_ZERO (pool)", "pfa M_ZERO (on demand)" };
+        unsigned int pass;
+        unsigned long i;
+
+        for (pass = 0; pass < 2; pass++)
+        {
+                uint64_t t;
+                if (pass == 0)
+                        pfa_zero_refill(PFA_ZERO_POOL_HIGH);
+                t = host_nsec();
+                for (i = 0; i < PFA_ZERO_POOL_HIGH; i++)
+                {
+                        page_t *p = pfa_alloc(M_USER);
+                        paddr_t pa = page_to_phys(p);
+                        pmm_map(&init_pmm, _va(pa), pa, M_USER, PFLAGS_RW);
+                        slots[i] = p;
+                }
+                report(names[pass], PFA_ZERO_POOL_HIGH, host_nsec() - t);
+                for (i = 0; i < PFA_ZERO_POOL_HIGH; i++)
+                        pfa_free(slots[i]);
+        }
+}
+
+/* Back a virtual range with single pages, first with plain and then
+ * with colored allocations, and count the pages whose color matches
+ * their address. */
+static void
+bench_pfa_color(void)
+{
+        const char *names[2] = { "pfa uncolored", "pfa colored" };
+        unsigned long match[2];
+        unsigned int pass;
+        unsigned long i;
+
+        for (pass = 0; pass < 2; pass++)
+        {
+                uint64_t t = host_nsec();
+                match[pass] = 0;
+                for (i = 0; i < BENCH_SLOTS; i++)
+                {
+                        vaddr_t va = i << PAGE_SHIFT;
+                        page_t *p = pass ? pfa_alloc_colored(M_HIGH, 0, va)
+                                         : pfa_alloc(M_HIGH);
+                        if ((page_to_pfn(p) & (PFA_NR_COLORS - 1)) ==
+                            pfa_color_of(va))
+                                match[pass]++;
+                        slots[i] = p;
+                }
+                report(names[pass], BENCH_SLOTS, host_nsec() - t);
+                for (i = 0; i < BENCH_SLOTS; i++)
+                        pfa_free(slots[i]);
+        }
+        kprintf(0, "%-24s %lu%% uncolored, %lu%% colored\n", "  color match",
+                match[0] * 100 / BENCH_SLOTS, match[1] * 100 / BENCH_SLOTS);
+}
+
+/* Mostly small allocations with a long tail, roughly what the kernel's
+ * own kmalloc callers look like. */
+static unsigned long
+kmalloc_size(void)
+{
+        uint32_t r = host_rand() % 100;
+        if (r < 50)
+                return 1 + host_rand() % 64;
+        if (r < 80)
+                return 65 + host_rand() % 192;
+        if (r < 95)
+                return 257 + host_rand() % 1792;
+        return 2049 + host_rand() % 6144;
+}
+
+static void
+bench_kmalloc(void)
+{
+        const unsigned long iters = 500000;
+        unsigned long i, ops = 0;
+        uint64_t t;
+
+        bzero(slots, sizeof(slots));
+        t = host_nsec();
+        for (i = 0; i < iters; i++)
+        {
+                unsigned long s = host_rand() % BENCH_SLOTS;
+                if (slots[s]) {
+                        kfree(slots[s]);
+                        slots[s] = NULL;
+                } else {
+                        slots[s] = kmalloc(kmalloc_size(), M_KERNEL);
+                }
+                ops++;
+        }
+        report("kmalloc mix", ops, host_nsec() - t);
+        for (i = 0; i < BENCH_SLOTS; i++)
+        {
+                kfree(slots[i]);
+                slots[i] = NULL;
+        }
+}
+
+/* A buffer grown a quarter at a time, as a table that keeps being
+ * appended to would be. */
+static void
+bench_krealloc(void)
+{
+        const unsigned long rounds = 2000;
+        unsigned long r, sz, ops = 0;
+        uint64_t t = host_nsec();
+        for (r = 0; r < rounds; r++)
+        {
+                char *p = kmalloc(16, M_KERNEL);
+                for (sz = 20; sz <= (256UL << 10); sz += sz / 4)
+                {
+                        p = krealloc(p, sz, M_KERNEL);
+                        if (!p)
+                                bug("krealloc failed");
+                        p[sz - 1] = (char)sz;
+                        ops++;
+                }
+                kfree(p);
+        }
+        report("krealloc growth", ops, host_nsec() - t);
+}
+
+static void
+bench_cache_hot(void)
+{
+        const unsigned long iters = 2000000;
+        mem_cache_t *cp = mem_cache_create("bench_64", 64, 0, 0,
+                                           NULL, NULL);
+        unsigned long i;
+        uint64_t t = host_nsec();
+        for (i = 0; i < iters; i++)
+        {
+                char *p = mem_cache_alloc(cp, M_KERNEL);
+                p[0] = (char)i;
+                mem_cache_free(cp, p);
+        }
+        report("mem_cache hot reuse", iters * 2, host_nsec() - t);
+        mem_cache_destroy(cp);
+}
+
+/* Without magazines every free goes back onto the slab freelist, so
+ * this shows which object the freelist hands out next: reusing the one
+ * just freed keeps the working set at one object, where going round the
+ * slab touches all of it. */
+static void
+bench_cache_freelist(void)
+{
+        const unsigned long iters = 500000;
+        mem_cache_t *cp = mem_cache_create("bench_freelist", 1024, 0,
+                                           SLAB_CACHE_NOMAG, NULL, NULL);
+        void *keep = mem_cache_alloc(cp, M_KERNEL);
+        unsigned long i;
+        uint64_t t = host_nsec();
+        for (i = 0; i < iters; i++)
+        {
+                char *p = mem_cache_alloc(cp, M_KERNEL);
+                memset(p, (int)i, 1024);
+                mem_cache_free(cp, p);
+        }
+        report("mem_cache freelist reuse", iters * 2, host_nsec() - t);
+        mem_cache_free(cp, keep);
+        mem_cache_destroy(cp);
+}
+
+static void
+bench_cache_batch(const char *label, const char *name, size_t size,
+                  mem_cache_flags_t flags)
+{
+        const unsigned long rounds = 200;
+        mem_cache_t *cp = mem_cache_create(name, size, 0, flags, NULL, NULL);
+        unsigned long r, i;
+        uint64_t t = host_nsec();
+        for (r = 0; r < rounds; r++)
+        {
+                for (i = 0; i < BENCH_SLOTS; i++)
+                        slots[i] = mem_cache_alloc(cp, M_KERNEL);
+                for (i = 0; i < BENCH_SLOTS; i++)
+                        mem_cache_free(cp, slots[i]);
+        }
+        report(label, rounds * BENCH_SLOTS * 2, host_nsec() - t);
+        mem_cache_destroy(cp);
+}
+
+/* The same batches as above, through the bulk interface. */
+static void
+bench_cache_bulk(const char *label, const char *name, size_t size,
+                 mem_cache_flags_t flags)
+{
+        const unsigned long rounds = 200;
+        mem_cache_t *cp = mem_cache_create(name, size, 0, flags, NULL, NULL);
+        unsigned long r;
+        uint64_t t = host_nsec();
+        for (r = 0; r < rounds; r++)
+        {
+                if (mem_cache_alloc_bulk(cp, M_KERNEL, BENCH_SLOTS, slots))
+                        bug("mem_cache_alloc_bulk failed");
+                mem_cache_free_bulk(cp, BENCH_SLOTS, slots);
+        }
+        report(label, rounds * BENCH_SLOTS * 2, host_nsec() - t);
+        mem_cache_destroy(cp);
+}
+
+int
+main(void)
+{
+        host_srand(0x5eed);
+        host_mm_init(BENCH_PAGES);
+
+        DO_TEST(pfa_test);
+        DO_TEST(vma_test);
+        DO_TEST(vmalloc_test);
+        DO_TEST(mempool_test);
+
+        bench_pfa_single();
+        bench_pfa_batch();
+        bench_pfa_churn();
+        bench_pfa_fragment();
+        bench_pfa_zone_pressure();
+        bench_pfa_compact();
+        bench_pfa_zero();
+        bench_pfa_color();
+        bench_kmalloc();
+        bench_krealloc();
+        bench_cache_hot();
+        bench_cache_freelist();
+        bench_cache_batch("mem_cache batch", "bench_192", 192, 0);
+        bench_cache_batch("mem_cache batch off-slab", "bench_1024", 1024, 0);
+        bench_cache_batch("mem_cache batch (no mags)", "bench_192", 192,
+                          SLAB_CACHE_NOMAG);
+        bench_cache_bulk("mem_cache bulk (no mags)", "bench_192", 192,
+                         SLAB_CACHE_NOMAG);
+        bench_cache_bulk("mem_cache bulk", "bench_192", 192, 0);
+
+        vma_report();
+        mem_cache_dump();
+        pfa_report(true);
+
+        /* Re-run the self-tests to check the books after the churn. */
+        DO_TEST(pfa_test);
+        DO_TEST(vma_test);
+        DO_TEST(vmalloc_test);
+        DO_TEST(mempool_test);
+        host_exit(0);
+}